@@ -29,6 +29,7 @@
 #include "aboot.h"
 #include "config.h"
 #include "cons.h"
+#include "prof.h"
 #include "setjmp.h"
 #include "utils.h"
 #include <string.h>
@@ -228,6 +229,8 @@ int main()
 		printf("aboot: kernel load failed (%ld)\n", result);
 		return 0;
 	}
+	prof_report();
+	heap_report();
 	printf("aboot: starting kernel %s with arguments %s\n",
 	       boot_file, kernel_args);
 	return 0;
@@ -242,7 +245,9 @@ main_ (void)
 {
 	long i, result;
 
+	prof_start(PROF_CONS_INIT);
 	cons_init();
+	prof_stop(PROF_CONS_INIT);
 
 	printf("aboot: Linux/Alpha SRM bootloader version "ABOOT_VERSION"\n");
 
@@ -263,6 +268,8 @@ main_ (void)
 		cons_close_console();
 		return;
 	}
+	prof_report();
+	heap_report();
 	printf("aboot: starting kernel %s with arguments %s\n",
 	       boot_file, kernel_args);
 	strcpy((char*)start_addr + PARAM_OFFSET, kernel_args);
@@ -4,6 +4,7 @@
 
 #include "aboot.h"
 #include "cons.h"
+#include "prof.h"
 #include "utils.h"
 #include <string.h>
 
@@ -103,62 +104,274 @@ cons_close(long dev)
 }
 
 
-long
-cons_read(long dev, void *buf, long count, long offset)
+/*
+ * Native sector size of each device read from.  CD-ROMs have 2048
+ * byte sectors and some disks 4096; the console counts the LBN of a
+ * read in those and may refuse transfers that aren't whole sectors.
+ * Nothing reports the size, so the first read from a device probes
+ * sector 0 with each candidate size in turn and keeps the smallest
+ * one the console accepts.
+ */
+#define MAX_SECT_SIZE	4096
+#define SECT_DEVS	4
+
+static struct sect_size {
+	long		dev;
+	long		size;		/* 0 if slot is free */
+} sect_sizes[SECT_DEVS];
+static int sect_next;			/* slot replaced next */
+
+
+/*
+ * Small sector cache shared by all filesystem drivers.  Superblocks,
+ * group descriptors, inode tables, directories and indirect blocks
+ * are read over and over again during mount and lookup, so keep the
+ * most recently used sectors around.  Reads larger than CACHE_BYPASS
+ * are file data and go straight to the device so that loading a
+ * kernel never evicts the metadata.  The cache works in SECT_SIZE
+ * units whatever the sector size of the device, a miss fills in all
+ * of the device sectors it read.
+ */
+#define CACHE_SECTORS	128		/* 64KB worth of sectors */
+#define CACHE_BYPASS	(16*SECT_SIZE)	/* don't cache larger reads */
+
+static struct cache_entry {
+	long		dev;
+	long		lbn;		/* in SECT_SIZE units */
+	unsigned long	stamp;		/* last use, 0 if slot is free */
+	char *		data;
+} cache[CACHE_SECTORS];
+
+static unsigned long cache_clock;
+static char *cache_iobuf;		/* staging buffer for misses */
+
+long cons_cache_hits;			/* reads served from the cache */
+long cons_cache_misses;			/* reads that went to the device */
+long cons_bounce_reads;			/* partial sectors read for unaligned I/O */
+
+
+static void
+cache_init(void)
 {
-	static char readbuf[SECT_SIZE];		/* minimize frame size */
+	char *data;
+	int i;
 
-	if ((count & (SECT_SIZE-1)) == 0 && (offset & (SECT_SIZE-1)) == 0) {
-		/* I/O is aligned... this is easy! */
-		return dispatch(CCB_READ, dev, count, buf,
-				offset / SECT_SIZE);
+	data = malloc(CACHE_SECTORS * SECT_SIZE);
+	/* a bypassed read rounded out to device sectors at both ends */
+	cache_iobuf = malloc(CACHE_BYPASS + 2 * MAX_SECT_SIZE);
+	for (i = 0; i < CACHE_SECTORS; ++i) {
+		cache[i].stamp = 0;
+		cache[i].data = data + i * SECT_SIZE;
+	}
+}
+
+
+static struct cache_entry *
+cache_lookup(long dev, long lbn)
+{
+	int i;
+
+	for (i = 0; i < CACHE_SECTORS; ++i) {
+		if (cache[i].stamp && cache[i].lbn == lbn
+		    && cache[i].dev == dev)
+		{
+			cache[i].stamp = ++cache_clock;
+			return &cache[i];
+		}
+	}
+	return 0;
+}
+
+
+static void
+cache_insert(long dev, long lbn, const char *data)
+{
+	struct cache_entry *victim = &cache[0];
+	int i;
+
+	for (i = 0; i < CACHE_SECTORS; ++i) {
+		if (cache[i].stamp && cache[i].lbn == lbn
+		    && cache[i].dev == dev)
+		{
+			victim = &cache[i];	/* already there, refresh */
+			break;
+		}
+		if (cache[i].stamp < victim->stamp)
+			victim = &cache[i];
+	}
+	victim->dev = dev;
+	victim->lbn = lbn;
+	victim->stamp = ++cache_clock;
+	memcpy(victim->data, data, SECT_SIZE);
+}
+
+
+/*
+ * Enter the COUNT bytes at DATA, read from byte OFFSET of the device,
+ * into the cache.
+ */
+static void
+cache_fill(long dev, long offset, const char *data, long count)
+{
+	long done;
+
+	for (done = 0; done < count; done += SECT_SIZE)
+		cache_insert(dev, (offset + done) / SECT_SIZE, data + done);
+}
+
+
+/*
+ * Return the sector size of DEV, probing for it on first use.
+ */
+static long
+sector_size(long dev)
+{
+	struct sect_size *ss;
+	long size;
+	int i;
+
+	for (i = 0; i < SECT_DEVS; ++i) {
+		if (sect_sizes[i].size && sect_sizes[i].dev == dev)
+			return sect_sizes[i].size;
+	}
+
+	for (size = SECT_SIZE; size <= MAX_SECT_SIZE; size <<= 1) {
+		if (dispatch(CCB_READ, dev, size, cache_iobuf, 0) == size)
+			break;
+	}
+	if (size > MAX_SECT_SIZE) {
+		size = SECT_SIZE;	/* let the real read report the error */
 	} else {
-		long bytesleft, iocount, blockoffset, iosize, lbn, retval;
-
-		bytesleft = count;
-		iocount = 0;
-		blockoffset = offset % SECT_SIZE;
-		lbn = offset / SECT_SIZE;
-
-		while (bytesleft > 0) {
-			if ((blockoffset == 0) && (bytesleft >= SECT_SIZE)) {
-				/*
-				 * This portion of the I/O is aligned,
-				 * so read it straight in:
-				 */
-				iosize = SECT_SIZE;
-				retval = dispatch(CCB_READ, dev, iosize, buf,
-						  lbn);
-				if (retval != iosize) {
-					printf("read error 0x%lx\n",retval);
-					return -1;
-				}
-			} else {
-				/*
-				 * Not aligned; must read it into a
-				 * temporary buffer and go from there.
-				 */
-				retval = dispatch(CCB_READ, dev, SECT_SIZE,
-						  readbuf, lbn);
-				if (retval != SECT_SIZE) {
-					printf("read error, lbn %ld: 0x%lx\n",
-					       lbn, retval);
-					return -1;
-				}
-				iosize = bytesleft;
-				if (blockoffset + iosize >= SECT_SIZE) {
-					iosize = SECT_SIZE - blockoffset;
-				}
-				memcpy(buf, readbuf + blockoffset, iosize);
-			}
-			buf += iosize;
-			iocount += iosize;
-			bytesleft -= iosize;
-			blockoffset = 0;
-			++lbn;
+		cache_fill(dev, 0, cache_iobuf, size);
+		if (size != SECT_SIZE)
+			printf("aboot: device %ld has %ld byte sectors\n",
+			       dev, size);
+	}
+
+	ss = &sect_sizes[sect_next];
+	sect_next = (sect_next + 1) % SECT_DEVS;
+	ss->dev = dev;
+	ss->size = size;
+	return size;
+}
+
+
+/*
+ * Serve a small read through the sector cache.  If any sector of the
+ * request is missing, the device sectors spanning it are fetched with
+ * a single device read, counted in *MISSES, and all of them are
+ * entered into the cache.
+ */
+static long
+cached_read(long dev, void *buf, long count, long offset, long *misses)
+{
+	struct cache_entry *ce;
+	long first, last, lbn, blockoffset, iosize, retval, left;
+	long ssize, start;
+
+	first = offset / SECT_SIZE;
+	last = (offset + count - 1) / SECT_SIZE;
+
+	for (lbn = first; lbn <= last; ++lbn) {
+		if (!cache_lookup(dev, lbn))
+			break;
+	}
+
+	if (lbn <= last) {
+		ssize = sector_size(dev);
+		++*misses;
+		start = offset & ~(ssize - 1);
+		iosize = ((offset + count + ssize - 1) & ~(ssize - 1)) - start;
+		retval = dispatch(CCB_READ, dev, iosize, cache_iobuf,
+				  start / ssize);
+		if (retval != iosize) {
+			printf("read error, lbn %ld: 0x%lx\n",
+			       start / ssize, retval);
+			return -1;
+		}
+		cache_fill(dev, start, cache_iobuf, iosize);
+		memcpy(buf, cache_iobuf + (offset - start), count);
+		return count;
+	}
+
+	++cons_cache_hits;
+	blockoffset = offset % SECT_SIZE;
+	for (lbn = first, left = count; left > 0; ++lbn) {
+		ce = cache_lookup(dev, lbn);
+		iosize = SECT_SIZE - blockoffset;
+		if (iosize > left)
+			iosize = left;
+		memcpy(buf, ce->data + blockoffset, iosize);
+		buf += iosize;
+		left -= iosize;
+		blockoffset = 0;
+	}
+	return count;
+}
+
+
+/*
+ * Read straight from the device.  An unaligned request is split into
+ * at most three transfers: a head sector bounced through the cache,
+ * one direct read of the aligned middle and a bounced tail sector.
+ */
+static long
+device_read(long dev, void *buf, long count, long offset)
+{
+	long ssize, blockoffset, iosize, retval, done;
+
+	ssize = sector_size(dev);
+	if ((count & (ssize-1)) == 0 && (offset & (ssize-1)) == 0) {
+		/* I/O is aligned... this is easy! */
+		return dispatch(CCB_READ, dev, count, buf, offset / ssize);
+	}
+
+	done = 0;
+	blockoffset = offset & (ssize - 1);
+
+	if (blockoffset) {
+		iosize = ssize - blockoffset;
+		if (iosize > count)
+			iosize = count;
+		if (cached_read(dev, buf, iosize, offset,
+				&cons_bounce_reads) < 0)
+			return -1;
+		done += iosize;
+	}
+
+	iosize = (count - done) & ~(ssize - 1);
+	if (iosize) {
+		retval = dispatch(CCB_READ, dev, iosize, buf + done,
+				  (offset + done) / ssize);
+		if (retval != iosize) {
+			printf("read error 0x%lx\n", retval);
+			return -1;
 		}
-		return iocount;
+		done += iosize;
+	}
+
+	if (done < count) {
+		if (cached_read(dev, buf + done, count - done,
+				offset + done, &cons_bounce_reads) < 0)
+			return -1;
+		done = count;
 	}
+	return done;
+}
+
+
+long
+cons_read(long dev, void *buf, long count, long offset)
+{
+	if (count <= 0)
+		return 0;
+	prof_io(count);
+	if (!cache_iobuf)
+		cache_init();
+	if (count <= CACHE_BYPASS)
+		return cached_read(dev, buf, count, offset,
+				   &cons_cache_misses);
+	return device_read(dev, buf, count, offset);
 }
 
 
@@ -30,6 +30,7 @@
 #include "bootfs.h"
 #include "cons.h"
 #include "disklabel.h"
+#include "prof.h"
 #include "utils.h"
 #include <string.h>
 
@@ -172,55 +173,58 @@ load_uncompressed (int fd)
 	return 0;
 }
 
+/*
+ * Load the kernel in FILENAME.  The format is picked from the magic at
+ * the start of the file: one of the decompressors registered in
+ * zip/misc.c, or a plain ELF image.
+ */
 static long
 read_kernel (const char *filename)
 {
-	volatile int attempt, method;
-	long len;
-	int fd;
-	static struct {
-		const char *name;
-		int (*func)(int fd);
-	} read_method[]= {
-		{"uncompressed", load_uncompressed},
-		{"compressed",	 uncompress_kernel}
-	};
-	long res;
-#	define NUM_METHODS ((int)(sizeof(read_method)/sizeof(read_method[0])))
+	const struct decompressor *dc;
+	struct arena decomp;
+	const char *name;
+	char *buf;
+	long nread, res;
+	int fd, phase;
 
 #ifdef DEBUG
 	printf("read_kernel(%s)\n", filename);
 #endif
 
-	method = 0;
-	len = strlen(filename);
-	if (len > 3 && filename[len - 3] == '.'
-	    && filename[len - 2] == 'g' && filename[len - 1] == 'z')
-	{
-		/* if filename ends in .gz we don't try plain method: */
-		method = 1;
+	prof_start(PROF_NAMEI);
+	fd = (*bfs->open)(filename);
+	prof_stop(PROF_NAMEI);
+	if (fd < 0) {
+		printf("%s: file not found\n", filename);
+		return -1;
 	}
 
-	for (attempt = 0; attempt < NUM_METHODS; ++attempt) {
-		fd = (*bfs->open)(filename);
-		if (fd < 0) {
-			printf("%s: file not found\n", filename);
-			return -1;
-		}
-		printf("aboot: loading %s %s...\n",
-		       read_method[method].name, filename);
-
-		if (!_setjmp(jump_buffer)) {
-			res = (*read_method[method].func)(fd);
+	buf = malloc(bfs->blocksize);
+	nread = (*bfs->bread)(fd, 0, 1, buf);
+	if (nread <= 0) {
+		printf("aboot: read of %s failed\n", filename);
+		(*bfs->close)(fd);
+		return -1;
+	}
+	dc = find_decompressor((unsigned char *) buf, nread);
+	name = dc ? dc->name : "uncompressed";
+	printf("aboot: loading %s %s...\n", name, filename);
 
-			(*bfs->close)(fd);
-			if (res >= 0) {
-				return 0;
-			}
-		}
-		method = (method + 1) % NUM_METHODS;
+	phase = dc ? PROF_DECOMPRESS : PROF_KERNEL_READ;
+	prof_start(phase);
+	/* decoder buffers are dead once the kernel is in place */
+	arena_enter(&decomp, "decompression");
+	if (!_setjmp(jump_buffer)) {
+		res = dc ? (*dc->load)(fd) : load_uncompressed(fd);
+	} else {
+		res = -1;	/* decoder bailed out through unzip_error() */
 	}
-	return -1;
+	arena_leave(&decomp);
+	prof_stop(phase);
+	(*bfs->close)(fd);
+
+	return res < 0 ? -1 : 0;
 }
 
 long
@@ -229,7 +233,9 @@ read_initrd()
 	int nblocks, nread, fd;
 	struct stat buf;
 
+	prof_start(PROF_NAMEI);
 	fd = (*bfs->open)(initrd_file);
+	prof_stop(PROF_NAMEI);
 	if (fd < 0) {
 		printf("%s: file not found\n", initrd_file);
 		return -1;
@@ -266,15 +272,15 @@ read_initrd()
 static void
 get_disklabel (long dev)
 {
-	static char lsect[512];
+	static char lsect[SECT_SIZE];
 	long nread;
 
 #ifdef DEBUG
 	printf("load_label(dev=%lx)\n", dev);
 #endif
-	nread = cons_read(dev, &lsect, LABELOFFSET + sizeof(*label),
-			  LABELSECTOR);
-	if (nread != LABELOFFSET + sizeof(*label)) {
+	/* the whole sector, cons_read() rounds to the device's anyway */
+	nread = cons_read(dev, &lsect, sizeof(lsect), LABELSECTOR * SECT_SIZE);
+	if (nread != sizeof(lsect)) {
 		printf("aboot: read of disklabel sector failed (nread=%ld)\n",
 		       nread);
 		return;
@@ -292,8 +298,80 @@ get_disklabel (long dev)
 }
 
 
-const struct bootfs *
-mount_fs (long dev, int partition)
+/*
+ * Directory entry cache.  A boot looks up names in the same few
+ * directories over and over (up to four config file names, then the
+ * kernel and the initrd), so the filesystems remember the outcome of
+ * each directory search here, including names that were not found
+ * (ino 0).  The entries belong to the mounted filesystem and are
+ * dropped when another one is mounted.
+ */
+#define DCACHE_ENTRIES	32
+#define DCACHE_NAME_MAX	32
+
+static struct dcache_entry {
+	unsigned long	dir;		/* inode searched, 0 if unused */
+	unsigned long	ino;		/* inode found, 0 if none */
+	int		len;
+	char		name[DCACHE_NAME_MAX];
+} dcache[DCACHE_ENTRIES];
+static int dcache_next;			/* entry replaced next */
+
+
+/*
+ * Look up NAME[0..LEN-1] in directory DIR.  Returns 1 and sets *INO
+ * if the outcome of that search is known, 0 if not.
+ */
+int
+dcache_lookup (unsigned long dir, const char *name, int len,
+	       unsigned long *ino)
+{
+	struct dcache_entry *d;
+
+	for (d = dcache; d < dcache + DCACHE_ENTRIES; ++d) {
+		if (d->dir == dir && d->len == len
+		    && memcmp(d->name, name, len) == 0)
+		{
+#ifdef DEBUG
+			printf("dcache: %.*s in %ld is %ld\n", len, name,
+			       dir, d->ino);
+#endif
+			*ino = d->ino;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* remember that NAME[0..LEN-1] in DIR is INO, or missing if INO is 0 */
+void
+dcache_enter (unsigned long dir, const char *name, int len,
+	      unsigned long ino)
+{
+	struct dcache_entry *d;
+
+	if (!dir || len > DCACHE_NAME_MAX)
+		return;
+	d = &dcache[dcache_next];
+	dcache_next = (dcache_next + 1) % DCACHE_ENTRIES;
+	d->dir = dir;
+	d->ino = ino;
+	d->len = len;
+	memcpy(d->name, name, len);
+}
+
+
+static void
+dcache_flush (void)
+{
+	memset(dcache, 0, sizeof(dcache));
+	dcache_next = 0;
+}
+
+
+static const struct bootfs *
+do_mount_fs (long dev, int partition)
 {
 	struct d_partition * part;
 	const struct bootfs * fs = 0;
@@ -344,6 +422,45 @@ mount_fs (long dev, int partition)
 			return 0;
 		}
 	}
+	return readahead_fs(fs);
+}
+
+
+/*
+ * Mount PARTITION of DEV.  The filesystem drivers keep their state in
+ * globals, so only one filesystem is mounted at a time: asking for the
+ * one already mounted returns it as is, as long as the memory it was
+ * mounted in has not been released since.  Mounting another one drops
+ * whatever the previous mount allocated.
+ */
+const struct bootfs *
+mount_fs (long dev, int partition)
+{
+	static struct arena mount_arena;
+	static const struct bootfs *mounted;
+	static long mounted_dev;
+	static int mounted_part;
+	const struct bootfs * fs;
+
+	if (mounted && dev == mounted_dev && partition == mounted_part
+	    && arena_live(&mount_arena))
+	{
+#ifdef DEBUG
+		printf("mount_fs(%lx, %d): already mounted\n", dev, partition);
+#endif
+		return mounted;
+	}
+
+	arena_leave(&mount_arena);
+	arena_enter(&mount_arena, "mount");
+	dcache_flush();
+	prof_start(PROF_MOUNT);
+	fs = do_mount_fs(dev, partition);
+	prof_stop(PROF_MOUNT);
+
+	mounted = fs;
+	mounted_dev = dev;
+	mounted_part = partition;
 	return fs;
 }
 
@@ -783,22 +900,27 @@ load (long dev)
 	}
 	/* clear bss: */
 	printf("aboot: zero-filling %ld bytes at 0x%p\n", bss_size, bss_start);
+	prof_start(PROF_BSS);
 #ifndef TESTING
 	memset((char*)bss_start, 0, bss_size);
 #endif
+	prof_stop(PROF_BSS);
 
 	if (initrd_file[0] == 0)
 		return 0;
 
-	/* work around a bug in the ext2 code */
+	/* a no-op unless this was a raw boot */
 	bfs = mount_fs(dev, boot_part);
 	if (!bfs) {
 		printf("aboot: mount of partition %d failed\n", boot_part);
 		return -1;
 	}
+	prof_start(PROF_INITRD);
 	if (read_initrd() < 0) {
+		prof_stop(PROF_INITRD);
 		return -1;
 	}
+	prof_stop(PROF_INITRD);
 	return 0;
 }
 
@@ -806,6 +928,7 @@ load (long dev)
 long
 load_kernel (void)
 {
+	struct arena attempt;
 	char envval[256];
 	long result;
 	long dev;
@@ -834,13 +957,17 @@ load_kernel (void)
 		return -1;
 	}
 	dev &= 0xffffffff;
+	prof_start(PROF_DISKLABEL);
 	get_disklabel(dev);
+	prof_stop(PROF_DISKLABEL);
 
 	while (1) {
+		arena_enter(&attempt, "load attempt");
 		get_aboot_options(dev);
 		result = load(dev);
 		if (result != -1)
 			break;
+		arena_leave(&attempt);
 		/* load failed---query user interactively */
 		strcpy(kernel_args, "i");
 	}
@@ -17,31 +17,98 @@
 #include <string.h>
 
 #define MAX_OPEN_FILES		5
+#define MAX_RUNS		1024	/* per open file, see ext2_build_runs */
+#define GD_CACHE_BLOCKS		4	/* group descriptor blocks kept */
+#define ITAB_CACHE_BLOCKS	4	/* inode table blocks kept */
 
 extern struct bootfs ext2fs;
 
 static struct ext2_super_block sb;
-static struct ext2_group_desc *gds;
 static struct ext2_inode *root_inode = NULL;
 static int ngroups = 0;
+static int gd_size;			/* bytes per group descriptor */
 static int directlim;			/* Maximum direct blkno */
 static int ind1lim;			/* Maximum single-indir blkno */
 static int ind2lim;			/* Maximum double-indir blkno */
 static int ptrs_per_blk;		/* ptrs/indirect block */
 static char *blkbuf;
-static int cached_iblkno = -1;
+static long cached_iblkno = -1;
 static char *iblkbuf;
-static int cached_diblkno = -1;
+static long cached_diblkno = -1;
 static char *diblkbuf;
 static long dev = -1;
 static long partition_offset;
 
+/*
+ * Group descriptors are read a block at a time when ext2_iget() first
+ * needs a group, so mounting doesn't read the whole table.
+ */
+static char *gdbuf;			/* GD_CACHE_BLOCKS blocks */
+static long cached_gdblk[GD_CACHE_BLOCKS];
+static int gd_next;			/* slot replaced next */
+
+/*
+ * Inodes are read out of whole inode table blocks, which are kept the
+ * same way: neighbouring inodes such as a kernel and its initrd
+ * usually share one.
+ */
+static char *itabbuf;			/* ITAB_CACHE_BLOCKS blocks */
+static long cached_itabblk[ITAB_CACHE_BLOCKS];
+static int itab_next;			/* slot replaced next */
+
+/*
+ * A contiguous piece of a file: LEN logical blocks starting at LBLK
+ * live at physical block PBLK (0 for a hole).
+ */
+struct ext2_run {
+	unsigned int	lblk;
+	unsigned int	pblk;
+	unsigned int	len;
+};
+
+static struct ext2_run *runbuf;		/* MAX_RUNS per inode table slot */
+
+static char *extbuf;			/* one block per extent tree level */
+static long cached_extblk[EXT4_EXT_MAX_DEPTH];
+
+/*
+ * Open inodes, shared by inumber and counted.  A slot whose count
+ * drops to zero keeps its inode (and block map) until the slot is
+ * needed for another inode, so reopening it costs nothing.
+ */
 static struct inode_table_entry {
 	struct	ext2_inode	inode;
-	int			inumber;
-	int			free;
+	int			inumber;	/* 0 if the slot holds none */
+	int			refs;		/* 0 if the slot is free */
+	unsigned long		released;	/* when refs last hit 0 */
 	unsigned short		old_mode;
+	struct ext2_run *	runs;		/* block map, if built */
+	int			nruns;
+	int			run_hint;	/* run used by the last read */
 } inode_table[MAX_OPEN_FILES];
+static unsigned long iput_clock;
+
+
+/* the number of blocks on the filesystem, 64bit ones have a _hi half */
+static unsigned long ext2_blocks_count(void)
+{
+	unsigned long count = sb.s_blocks_count;
+
+	if (sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		count |= (unsigned long) sb.s_blocks_count_hi << 32;
+	return count;
+}
+
+
+/* the size of IP; regular files keep the upper 32 bits in i_size_high */
+static long ext2_isize(struct ext2_inode *ip)
+{
+	long size = ip->i_size;
+
+	if (S_ISREG(ip->i_mode))
+		size |= (long) ip->i_size_high << 32;
+	return size;
+}
 
 
 /*
@@ -61,9 +128,11 @@ static int ext2_mount(long cons_dev, long p_offset, long quiet)
 
 	/* initialize the inode table */
 	for (i = 0; i < MAX_OPEN_FILES; i++) {
-		inode_table[i].free = 1;
+		inode_table[i].refs = 0;
 		inode_table[i].inumber = 0;
+		inode_table[i].released = 0;
 	}
+	iput_clock = 0;
 	/* clear the root inode pointer (very important!) */
 	root_inode = NULL;
 
@@ -83,22 +152,43 @@ static int ext2_mount(long cons_dev, long p_offset, long quiet)
 		return -1;
 	}
 
-	ngroups = (sb.s_blocks_count -
+	ext2fs.blocksize = EXT2_BLOCK_SIZE(&sb);
+
+	/* 64bit filesystems have bigger descriptors with _hi halves */
+	gd_size = sizeof(struct ext2_group_desc);
+	if (sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		gd_size = sb.s_desc_size;
+		if (gd_size < EXT2_MIN_DESC_SIZE_64BIT
+		    || gd_size > ext2fs.blocksize || (gd_size & (gd_size - 1)))
+		{
+			printf("ext2_init: bad descriptor size %d\n", gd_size);
+			return -1;
+		}
+	}
+
+	ngroups = (ext2_blocks_count() -
 		   sb.s_first_data_block +
 		   EXT2_BLOCKS_PER_GROUP(&sb) - 1)
 		/ EXT2_BLOCKS_PER_GROUP(&sb);
 
-	gds = malloc((size_t)(ngroups * sizeof(struct ext2_group_desc)));
-
-	ext2fs.blocksize = EXT2_BLOCK_SIZE(&sb);
 	blkbuf = malloc(ext2fs.blocksize);
 	iblkbuf = malloc(ext2fs.blocksize);
 	diblkbuf = malloc(ext2fs.blocksize);
+	cached_iblkno = -1;
+	cached_diblkno = -1;
+	runbuf = malloc(MAX_OPEN_FILES * MAX_RUNS * sizeof(struct ext2_run));
+	extbuf = malloc(EXT4_EXT_MAX_DEPTH * ext2fs.blocksize);
+	for (i = 0; i < EXT4_EXT_MAX_DEPTH; i++)
+		cached_extblk[i] = -1;
+	gdbuf = malloc(GD_CACHE_BLOCKS * ext2fs.blocksize);
+	for (i = 0; i < GD_CACHE_BLOCKS; i++)
+		cached_gdblk[i] = -1;
+	gd_next = 0;
+	itabbuf = malloc(ITAB_CACHE_BLOCKS * ext2fs.blocksize);
+	for (i = 0; i < ITAB_CACHE_BLOCKS; i++)
+		cached_itabblk[i] = -1;
+	itab_next = 0;
 
-	/* read in the group descriptors (immediately follows superblock) */
-	cons_read(dev, gds, ngroups * sizeof(struct ext2_group_desc),
-		  partition_offset +
-                  ext2fs.blocksize * (EXT2_MIN_BLOCK_SIZE/ext2fs.blocksize + 1));
 	/*
 	 * Calculate direct/indirect block limits for this file system
 	 * (blocksize dependent):
@@ -113,8 +203,143 @@ static int ext2_mount(long cons_dev, long p_offset, long quiet)
 }
 
 
+/* is N a power of B? */
+static int ext2_is_power(int n, int b)
+{
+	while (n > b && n % b == 0)
+		n /= b;
+	return n == b;
+}
+
+
+/* does GROUP start with a superblock backup? */
+static int ext2_has_super(int group)
+{
+	if (group <= 1
+	    || !(sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return 1;
+	return ext2_is_power(group, 3) || ext2_is_power(group, 5)
+		|| ext2_is_power(group, 7);
+}
+
+
+/*
+ * Return the block holding the descriptor of GROUP.  Normally the
+ * descriptor table immediately follows the superblock.  With meta_bg,
+ * each run of one block's worth of groups past s_first_meta_bg keeps
+ * its descriptor block in its own first group instead, just after
+ * that group's superblock backup, if there is one.
+ */
+static long ext2_gd_block(int group)
+{
+	int per_blk = ext2fs.blocksize / gd_size;
+	long metagroup = group / per_blk;
+	int first;
+
+	if (!(sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+	    || metagroup < sb.s_first_meta_bg)
+		return sb.s_first_data_block + 1 + metagroup;
+
+	first = metagroup * per_blk;
+	return sb.s_first_data_block
+		+ (long) first * EXT2_BLOCKS_PER_GROUP(&sb)
+		+ ext2_has_super(first);
+}
+
+
+/*
+ * Return the descriptor of group GROUP, reading the block that holds
+ * it if it isn't cached.  Returns NULL on a read error.  Only the
+ * 32-byte head is used as a struct ext2_group_desc; the _hi halves of
+ * 64bit descriptors are picked up by ext2_inode_table().
+ */
+static struct ext2_group_desc *ext2_get_gd(int group)
+{
+	int per_blk = ext2fs.blocksize / gd_size;
+	long gdblk;
+	char *buf;
+	int i;
+
+	if (group < 0 || group >= ngroups) {
+		printf("ext2_get_gd: bad group %d\n", group);
+		return NULL;
+	}
+	gdblk = ext2_gd_block(group);
+
+	for (i = 0; i < GD_CACHE_BLOCKS; i++) {
+		if (cached_gdblk[i] == gdblk)
+			break;
+	}
+	if (i == GD_CACHE_BLOCKS) {
+		i = gd_next;
+		gd_next = (gd_next + 1) % GD_CACHE_BLOCKS;
+		cached_gdblk[i] = -1;
+#ifdef DEBUG_EXT2
+		printf("ext2_get_gd: reading descriptor block %ld\n", gdblk);
+#endif
+		if (cons_read(dev, gdbuf + i * ext2fs.blocksize,
+			      ext2fs.blocksize,
+			      partition_offset + gdblk * ext2fs.blocksize)
+		    != ext2fs.blocksize)
+		{
+			printf("ext2_get_gd: read error\n");
+			return NULL;
+		}
+		cached_gdblk[i] = gdblk;
+	}
+	buf = gdbuf + i * ext2fs.blocksize;
+	return (struct ext2_group_desc *) (buf + (group % per_blk) * gd_size);
+}
+
+
+/*
+ * The first block of the inode table described by GD.  With flex_bg
+ * it need not be inside the group itself, but the descriptor always
+ * has its absolute location.
+ */
+static unsigned long ext2_inode_table(struct ext2_group_desc *gd)
+{
+	unsigned long blk = gd->bg_inode_table;
+
+	if (gd_size >= EXT2_MIN_DESC_SIZE_64BIT)
+		blk |= (unsigned long)
+			((struct ext4_group_desc *) gd)->bg_inode_table_hi << 32;
+	return blk;
+}
+
+
+/*
+ * Return a pointer to the inode table block BLK, reading it if it
+ * isn't cached.  Returns NULL on a read error.
+ */
+static char *ext2_itab_block(long blk)
+{
+	int i;
+
+	for (i = 0; i < ITAB_CACHE_BLOCKS; i++) {
+		if (cached_itabblk[i] == blk)
+			return itabbuf + i * ext2fs.blocksize;
+	}
+	i = itab_next;
+	itab_next = (itab_next + 1) % ITAB_CACHE_BLOCKS;
+	cached_itabblk[i] = -1;
+#ifdef DEBUG_EXT2
+	printf("ext2_itab_block: reading inode table block %ld\n", blk);
+#endif
+	if (cons_read(dev, itabbuf + i * ext2fs.blocksize, ext2fs.blocksize,
+		      partition_offset + blk * ext2fs.blocksize)
+	    != ext2fs.blocksize)
+	{
+		return NULL;
+	}
+	cached_itabblk[i] = blk;
+	return itabbuf + i * ext2fs.blocksize;
+}
+
+
 /*
  * Read the specified inode from the disk and return it to the user.
+ * An inode that is already open, or was recently, is shared instead.
  * Returns NULL if the inode can't be read...
  */
 static struct ext2_inode *ext2_iget(int ino)
@@ -122,53 +347,67 @@ static struct ext2_inode *ext2_iget(int ino)
 	int i;
 	struct ext2_inode *ip;
 	struct inode_table_entry *itp = 0;
+	struct ext2_group_desc *gd;
 	int group;
 	long offset;
+	char *blk;
 
-	ip = 0;
 	for (i = 0; i < MAX_OPEN_FILES; i++) {
 #ifdef DEBUG_EXT2
-		printf("ext2_iget: looping, entry %d inode %d free %d\n",
-		       i, inode_table[i].inumber, inode_table[i].free);
+		printf("ext2_iget: looping, entry %d inode %d refs %d\n",
+		       i, inode_table[i].inumber, inode_table[i].refs);
 #endif
-		if (inode_table[i].free) {
+		if (inode_table[i].inumber == ino) {
+			itp = &inode_table[i];
+			itp->refs++;
+			return &itp->inode;
+		}
+		/* an empty slot, else the one released longest ago */
+		if (inode_table[i].refs == 0
+		    && (!itp || (itp->inumber
+				 && (!inode_table[i].inumber
+				     || inode_table[i].released
+					< itp->released))))
+		{
 			itp = &inode_table[i];
-			ip = &itp->inode;
-			break;
 		}
 	}
-	if (!ip) {
+	if (!itp) {
 		printf("ext2_iget: no free inodes\n");
 		return NULL;
 	}
+	ip = &itp->inode;
 
 	group = (ino-1) / sb.s_inodes_per_group;
 #ifdef DEBUG_EXT2
 	printf("group is %d\n", group);
 #endif
-	offset = partition_offset
-		+ ((long) gds[group].bg_inode_table * (long)ext2fs.blocksize)
+	gd = ext2_get_gd(group);
+	if (!gd)
+		return NULL;
+	/* byte offset of the inode from the start of the filesystem */
+	offset = ((long) ext2_inode_table(gd) * (long)ext2fs.blocksize)
 		+ (((ino - 1) % EXT2_INODES_PER_GROUP(&sb))
 		   * EXT2_INODE_SIZE(&sb));
 #ifdef DEBUG_EXT2
-	printf("ext2_iget: reading %ld bytes at offset %ld "
-	       "(%ld + (%d * %d) + ((%d) %% %d) * %d) "
-	       "(inode %d -> table %d)\n",
-	       sizeof(struct ext2_inode), offset, partition_offset,
-	       gds[group].bg_inode_table, ext2fs.blocksize,
+	printf("ext2_iget: inode %d at offset %ld "
+	       "(%lu * %d + ((%d) %% %d) * %d) "
+	       "-> table %d\n",
+	       ino, offset, ext2_inode_table(gd), ext2fs.blocksize,
 	       ino - 1, EXT2_INODES_PER_GROUP(&sb), EXT2_INODE_SIZE(&sb),
-	       ino, (int) (itp - inode_table));
+	       (int) (itp - inode_table));
 #endif
-	if (cons_read(dev, ip, sizeof(struct ext2_inode), offset)
-	    != sizeof(struct ext2_inode))
-	{
+	blk = ext2_itab_block(offset / ext2fs.blocksize);
+	if (!blk) {
 		printf("ext2_iget: read error\n");
 		return NULL;
 	}
+	memcpy(ip, blk + offset % ext2fs.blocksize, sizeof(struct ext2_inode));
 
-	itp->free = 0;
+	itp->refs = 1;
 	itp->inumber = ino;
 	itp->old_mode = ip->i_mode;
+	itp->nruns = 0;
 
 	return ip;
 }
@@ -176,7 +415,8 @@ static struct ext2_inode *ext2_iget(int ino)
 
 /*
  * Release our hold on an inode.  Since this is a read-only application,
- * don't worry about putting back any changes...
+ * don't worry about putting back any changes...  The inode stays in
+ * its slot for ext2_iget() to find until the slot is reused.
  */
 static void ext2_iput(struct ext2_inode *ip)
 {
@@ -186,11 +426,11 @@ static void ext2_iput(struct ext2_inode *ip)
 	itp = (struct inode_table_entry *)ip;
 
 #ifdef DEBUG_EXT2
-	printf("ext2_iput: inode %d table %d\n", itp->inumber,
-	       (int) (itp - inode_table));
+	printf("ext2_iput: inode %d table %d refs %d\n", itp->inumber,
+	       (int) (itp - inode_table), itp->refs);
 #endif
-	itp->inumber = 0;
-	itp->free = 1;
+	if (itp->refs > 0 && --itp->refs == 0)
+		itp->released = ++iput_clock;
 }
 
 
@@ -203,13 +443,13 @@ static void ext2_iput(struct ext2_inode *ip)
  * The "allocate" argument is set if we want to *allocate* a block
  * and we don't already have one allocated.
  */
-static int ext2_blkno(struct ext2_inode *ip, int blkoff)
+static unsigned int ext2_blkno(struct ext2_inode *ip, int blkoff)
 {
 	unsigned int *ilp;
 	unsigned int *dlp;
-	int blkno;
-	int iblkno;
-	int diblkno;
+	unsigned int blkno;
+	unsigned int iblkno;
+	unsigned int diblkno;
 	unsigned long offset;
 
 	ilp = (unsigned int *)iblkbuf;
@@ -292,56 +532,355 @@ static int ext2_blkno(struct ext2_inode *ip, int blkoff)
 
 	if (blkoff > ind2lim) {
 		printf("ext2_blkno: block number too large: %d\n", blkoff);
-		return 0;
 	}
-	return -1;
+	return 0;
 }
 
-static int ext4_breadi(struct ext2_inode *ip, long blkno, long nblks, char *buffer)
+/*
+ * Append LEN blocks starting at logical block LBLK and physical block
+ * PBLK to the run list of ITP, merging with the last run when the two
+ * are contiguous.  Returns -1 when the list is full.
+ */
+static int ext2_add_run(struct inode_table_entry *itp, unsigned int lblk,
+			unsigned int pblk, unsigned int len)
 {
-	long tot_bytes = 0;
+	struct ext2_run *run;
+
+	if (itp->nruns) {
+		run = &itp->runs[itp->nruns - 1];
+		if (run->lblk + run->len == lblk
+		    && ((run->pblk == 0 && pblk == 0)
+			|| (run->pblk && pblk == run->pblk + run->len)))
+		{
+			run->len += len;
+			return 0;
+		}
+	}
+	if (itp->nruns >= MAX_RUNS)
+		return -1;
+	run = &itp->runs[itp->nruns++];
+	run->lblk = lblk;
+	run->pblk = pblk;
+	run->len = len;
+	return 0;
+}
 
-	struct ext4_extent_header *hdr;
-	hdr = (struct ext4_extent_header *)&ip->i_block[0];
 
-	if (hdr->eh_magic != EXT4_EXT_MAGIC) {
-		printf("ext4_breadi: Extent header magic wrong.\n");
-		return -1;
+/*
+ * Add the blocks mapped by indirect block IBLKNO (whose first entry is
+ * logical block LBLK) to the run list, stopping at NBLOCKS.
+ */
+static int ext2_add_ind_runs(struct inode_table_entry *itp,
+			     unsigned int iblkno,
+			     unsigned int lblk, unsigned int nblocks)
+{
+	unsigned int *ilp = (unsigned int *)iblkbuf;
+	unsigned int i, n;
+
+	n = nblocks - lblk;
+	if (n > ptrs_per_blk)
+		n = ptrs_per_blk;
+	if (iblkno == 0)
+		return ext2_add_run(itp, lblk, 0, n);
+
+	if (cached_iblkno != iblkno) {
+		if (cons_read(dev, iblkbuf, ext2fs.blocksize,
+			      partition_offset
+			      + (long) iblkno * (long) ext2fs.blocksize)
+		    != ext2fs.blocksize)
+		{
+			printf("ext2_build_runs: error on iblk read\n");
+			cached_iblkno = -1;
+			return -1;
+		}
+		cached_iblkno = iblkno;
 	}
+	for (i = 0; i < n; ++i) {
+		if (ext2_add_run(itp, lblk + i, ilp[i], 1) < 0)
+			return -1;
+	}
+	return 0;
+}
 
-	if (hdr->eh_entries != 1) {
-		printf("ext4_breadi: Extent entries must be 1.\n");
-		return -1;
+
+/*
+ * Walk the indirect tree of a regular file once and turn it into a
+ * list of contiguous runs, so that reads of the file need neither
+ * ext2_blkno() nor any more indirect block reads.  Files that are
+ * too fragmented to fit in MAX_RUNS keep using ext2_blkno().
+ */
+static void ext2_build_runs(struct inode_table_entry *itp)
+{
+	struct ext2_inode *ip = &itp->inode;
+	unsigned int *dlp = (unsigned int *)diblkbuf;
+	unsigned int nblocks, lblk, diblkno;
+	int i;
+
+	itp->nruns = 0;
+	itp->run_hint = 0;
+	itp->runs = runbuf + (itp - inode_table) * MAX_RUNS;
+
+	nblocks = (ext2_isize(ip) + ext2fs.blocksize - 1) / ext2fs.blocksize;
+	if (nblocks <= EXT2_NDIR_BLOCKS || nblocks > ind2lim + 1)
+		return;
+
+	for (lblk = 0; lblk <= directlim; ++lblk) {
+		if (ext2_add_run(itp, lblk, ip->i_block[lblk], 1) < 0)
+			goto fail;
 	}
 
-	struct ext4_extent *ext;
-	ext = (struct ext4_extent *)&ip->i_block[3];
+	if (ext2_add_ind_runs(itp, ip->i_block[EXT2_IND_BLOCK], lblk, nblocks)
+	    < 0)
+		goto fail;
+	lblk += ptrs_per_blk;
 
-	if (ext->ee_block != 0) {
-		printf("ext4_breadi: First logical block must be 0.\n");
-		return -1;
+	diblkno = ip->i_block[EXT2_DIND_BLOCK];
+	if (lblk < nblocks && diblkno) {
+		if (cached_diblkno != diblkno) {
+			if (cons_read(dev, diblkbuf, ext2fs.blocksize,
+				      partition_offset
+				      + (long) diblkno * (long) ext2fs.blocksize)
+			    != ext2fs.blocksize)
+			{
+				printf("ext2_build_runs: err reading dindr blk\n");
+				cached_diblkno = -1;
+				goto fail;
+			}
+			cached_diblkno = diblkno;
+		}
+	}
+	for (i = 0; lblk < nblocks; ++i, lblk += ptrs_per_blk) {
+		if (ext2_add_ind_runs(itp, diblkno ? dlp[i] : 0, lblk, nblocks)
+		    < 0)
+			goto fail;
+	}
+#ifdef DEBUG_EXT2
+	printf("ext2_build_runs: inode %d, %u blocks in %d runs\n",
+	       itp->inumber, nblocks, itp->nruns);
+#endif
+	return;
+
+fail:
+	itp->nruns = 0;
+}
+
+
+/*
+ * Read from a file that has a run list.  Blocks past the end of the
+ * list are treated as holes, just like ext2_blkno() does.
+ */
+static int ext2_breadi_runs(struct inode_table_entry *itp, long blkno,
+			    long nblks, char *buffer)
+{
+	struct ext2_run *run;
+	long n, nbytes, offset, tot_bytes = 0;
+	int lo, hi, mid;
+
+	while (nblks > 0) {
+		/* usually the same run as last time, or the next one */
+		run = &itp->runs[itp->run_hint];
+		if (blkno < run->lblk || blkno >= run->lblk + run->len) {
+			if (itp->run_hint + 1 < itp->nruns
+			    && blkno >= run[1].lblk
+			    && blkno < run[1].lblk + run[1].len)
+			{
+				itp->run_hint++;
+			} else {
+				lo = 0;
+				hi = itp->nruns - 1;
+				while (lo < hi) {
+					mid = (lo + hi + 1) / 2;
+					if (itp->runs[mid].lblk <= blkno)
+						lo = mid;
+					else
+						hi = mid - 1;
+				}
+				itp->run_hint = lo;
+			}
+			run = &itp->runs[itp->run_hint];
+		}
+
+		if (blkno >= run->lblk + run->len) {
+			/* past the last run */
+			n = nblks;
+			nbytes = n * ext2fs.blocksize;
+			memset(buffer, 0, nbytes);
+		} else {
+			n = run->lblk + run->len - blkno;
+			if (n > nblks)
+				n = nblks;
+			nbytes = n * ext2fs.blocksize;
+			if (run->pblk == 0) {
+				/* This is a "hole" */
+				memset(buffer, 0, nbytes);
+			} else {
+				offset = partition_offset
+					+ (long) (run->pblk + (blkno - run->lblk))
+					* (long) ext2fs.blocksize;
+#ifdef DEBUG_EXT2
+				printf("ext2_bread: reading %ld bytes at offset %ld\n",
+				       nbytes, offset);
+#endif
+				if (cons_read(dev, buffer, nbytes, offset)
+				    != nbytes)
+				{
+					printf("ext2_bread: read error\n");
+					return -1;
+				}
+			}
+		}
+		blkno     += n;
+		nblks     -= n;
+		buffer    += nbytes;
+		tot_bytes += nbytes;
 	}
+	return tot_bytes;
+}
 
-	if (nblks > ext->ee_len) {
-		printf("ext4_breadi: Request nblks greater than extent len.\n");
+/*
+ * Find the extent that maps logical block LBLK of IP.  Walks the
+ * extent tree from the inode down to the leaf, keeping the last block
+ * read at every level so that sequential reads hit memory.  On return
+ * *PBLK is the physical block (0 for a hole or an unwritten extent)
+ * and *LEN the number of blocks from LBLK on that are mapped the same
+ * way.  Returns 0 on success, -1 on a corrupt tree or read error.
+ */
+static int ext4_ext_find(struct ext2_inode *ip, unsigned int lblk,
+			 unsigned long *pblk, unsigned long *len)
+{
+	struct ext4_extent_header *hdr;
+	struct ext4_extent_idx *idx;
+	struct ext4_extent *ext;
+	unsigned long next = ~0UL;	/* first block of the next extent */
+	unsigned long leaf;
+	int depth, level, i, cap;
+
+	hdr = (struct ext4_extent_header *)&ip->i_block[0];
+	depth = hdr->eh_depth;
+	if (depth > EXT4_EXT_MAX_DEPTH) {
+		printf("ext4_ext_find: extent tree too deep (%d)\n", depth);
 		return -1;
 	}
 
-	long ee_start = ((long)ext->ee_start_hi << 32) + ext->ee_start_lo;
+	for (level = 0; ; ++level) {
+		if (hdr->eh_magic != EXT4_EXT_MAGIC) {
+			printf("ext4_ext_find: Extent header magic wrong.\n");
+			return -1;
+		}
+		/* entries (index or extent, 12 bytes either way) that fit */
+		cap = ((level ? ext2fs.blocksize : sizeof(ip->i_block))
+		       - sizeof(*hdr)) / sizeof(struct ext4_extent);
+		if (hdr->eh_depth != depth - level
+		    || hdr->eh_entries > hdr->eh_max || hdr->eh_max > cap)
+		{
+			printf("ext4_ext_find: corrupt extent header.\n");
+			return -1;
+		}
+		if (hdr->eh_depth == 0)
+			break;
 
-	if (blkno + nblks > ext->ee_len) {
-		nblks = ext->ee_len - blkno;
+		/* last index entry starting at or before lblk */
+		idx = (struct ext4_extent_idx *)(hdr + 1);
+		for (i = 0; i < hdr->eh_entries - 1; ++i) {
+			if (idx[i + 1].ei_block > lblk)
+				break;
+		}
+		if (hdr->eh_entries == 0 || idx[i].ei_block > lblk) {
+			/* hole in front of the first index entry */
+			if (hdr->eh_entries && idx[0].ei_block < next)
+				next = idx[0].ei_block;
+			goto hole;
+		}
+		if (i + 1 < hdr->eh_entries && idx[i + 1].ei_block < next)
+			next = idx[i + 1].ei_block;
+
+		leaf = ((unsigned long) idx[i].ei_leaf_hi << 32)
+			| idx[i].ei_leaf_lo;
+		if (cached_extblk[level] != leaf) {
+			if (cons_read(dev, extbuf + level * ext2fs.blocksize,
+				      ext2fs.blocksize,
+				      partition_offset + leaf * ext2fs.blocksize)
+			    != ext2fs.blocksize)
+			{
+				printf("ext4_ext_find: read error\n");
+				cached_extblk[level] = -1;
+				return -1;
+			}
+			cached_extblk[level] = leaf;
+		}
+		hdr = (struct ext4_extent_header *)
+			(extbuf + level * ext2fs.blocksize);
 	}
 
-	long offset = partition_offset + (ee_start + blkno) * ext2fs.blocksize;
-	long nbytes = nblks * ext2fs.blocksize;
+	/* last extent starting at or before lblk */
+	ext = (struct ext4_extent *)(hdr + 1);
+	for (i = 0; i < hdr->eh_entries - 1; ++i) {
+		if (ext[i + 1].ee_block > lblk)
+			break;
+	}
+	if (hdr->eh_entries == 0 || ext[i].ee_block > lblk) {
+		if (hdr->eh_entries && ext[0].ee_block < next)
+			next = ext[0].ee_block;
+		goto hole;
+	}
+	if (i + 1 < hdr->eh_entries && ext[i + 1].ee_block < next)
+		next = ext[i + 1].ee_block;
 
-	tot_bytes = cons_read(dev, buffer, nbytes, offset);
-	if (tot_bytes != nbytes) {
-		printf("ext4_breadi: cons_read failed.\n");
-		return -1;
+	if (ext[i].ee_len > EXT_INIT_MAX_LEN) {
+		/* unwritten (preallocated) extent, reads as zeroes */
+		*len = ext[i].ee_len - EXT_INIT_MAX_LEN;
+		*pblk = 0;
+	} else {
+		*len = ext[i].ee_len;
+		*pblk = (((unsigned long) ext[i].ee_start_hi << 32)
+			 | ext[i].ee_start_lo) + (lblk - ext[i].ee_block);
 	}
+	if (ext[i].ee_block + *len > lblk) {
+		*len = ext[i].ee_block + *len - lblk;
+		return 0;
+	}
+
+hole:
+	*pblk = 0;
+	*len = next - lblk;
+	return 0;
+}
 
+static int ext4_breadi(struct ext2_inode *ip, long blkno, long nblks, char *buffer)
+{
+	unsigned long pblk, len;
+	long offset, nbytes, tot_bytes = 0;
+
+	if ((blkno+nblks)*ext2fs.blocksize > ext2_isize(ip))
+		nblks = (ext2_isize(ip) + ext2fs.blocksize) / ext2fs.blocksize
+			- blkno;
+
+	while (nblks > 0) {
+		if (ext4_ext_find(ip, blkno, &pblk, &len) < 0)
+			return -1;
+		if (len > nblks)
+			len = nblks;
+		nbytes = len * ext2fs.blocksize;
+
+		if (pblk == 0) {
+			/* hole or unwritten extent */
+			memset(buffer, 0, nbytes);
+		} else {
+			offset = partition_offset + pblk * ext2fs.blocksize;
+#ifdef DEBUG_EXT2
+			printf("ext4_bread: reading %ld bytes at offset %ld\n",
+			       nbytes, offset);
+#endif
+			if (cons_read(dev, buffer, nbytes, offset) != nbytes) {
+				printf("ext4_breadi: cons_read failed.\n");
+				return -1;
+			}
+		}
+		blkno     += len;
+		nblks     -= len;
+		buffer    += nbytes;
+		tot_bytes += nbytes;
+	}
 	return tot_bytes;
 }
 
@@ -355,8 +894,13 @@ static int ext2_breadi(struct ext2_inode *ip, long blkno, long nblks, char *buff
 	}
 
 	tot_bytes = 0;
-	if ((blkno+nblks)*ext2fs.blocksize > ip->i_size)
-		nblks = (ip->i_size + ext2fs.blocksize) / ext2fs.blocksize - blkno;
+	if ((blkno+nblks)*ext2fs.blocksize > ext2_isize(ip))
+		nblks = (ext2_isize(ip) + ext2fs.blocksize) / ext2fs.blocksize
+			- blkno;
+
+	if (((struct inode_table_entry *)ip)->nruns)
+		return ext2_breadi_runs((struct inode_table_entry *)ip,
+					blkno, nblks, buffer);
 
 	while (nblks) {
 		/*
@@ -445,53 +989,357 @@ static struct ext2_dir_entry_2 *ext2_readdiri(struct ext2_inode *dir_inode,
 	return dp;
 }
 
+/*
+ * Hashed directories (dir_index).  Block 0 of an indexed directory
+ * holds "." and "..", whose rec_len covers the rest of the block, and
+ * after them the root of a tree of (hash, block) pairs sorted by
+ * hash.  Interior nodes look like a block with one empty dirent.  The
+ * leaves are ordinary directory blocks, so a lookup only needs to read
+ * one block per level plus the leaf.  The hash functions are those of
+ * the Linux ext4 driver (fs/ext4/hash.c).
+ */
+#define DX_MAX_LEVELS		3
+#define DX_HASH_EOF		0x7fffffff
+
+#define DX_ROL(x, s)		(((x) << (s)) | ((x) >> (32 - (s))))
+#define DX_F(x, y, z)		((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z)		(((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z)		((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) \
+	(a += f(b, c, d) + (x), a = DX_ROL(a, s))
+#define DX_K2			0x5a827999
+#define DX_K3			0x6ed9eba1
+
+static void dx_half_md4(unsigned int buf[4], const unsigned int in[8])
+{
+	unsigned int a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0],  3);
+	DX_ROUND(DX_F, d, a, b, c, in[1],  7);
+	DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4],  3);
+	DX_ROUND(DX_F, d, a, b, c, in[5],  7);
+	DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static void dx_tea(unsigned int buf[4], const unsigned int in[4])
+{
+	unsigned int sum = 0, b0 = buf[0], b1 = buf[1];
+	int n;
+
+	for (n = 0; n < 16; ++n) {
+		sum += 0x9e3779b9;
+		b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+		b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/* character I of NAME, sign-extended unless the hash is unsigned */
+#define DX_CHAR(name, i, uns) \
+	((uns) ? (int) (unsigned char) (name)[i] : (int) (signed char) (name)[i])
+
+/* pack up to NUM words of NAME[0..LEN-1] into BUF, padded with the length */
+static void dx_str2hashbuf(const char *name, int len, unsigned int *buf,
+			   int num, int uns)
+{
+	unsigned int pad, val;
+	int i;
+
+	pad = (unsigned int) len | ((unsigned int) len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		val = DX_CHAR(name, i, uns) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+/*
+ * Hash NAME[0..LEN-1] with hash VERSION the way the kernel does.
+ * Returns 0 and sets *HASH, or -1 for a hash we don't know.
+ */
+static int dx_hash(int version, const char *name, int len,
+		   unsigned int *hash)
+{
+	unsigned int buf[4], in[8];
+	unsigned int h0 = 0x12a3fe2d, h1 = 0x37abe8f9, h;
+	int uns = 0, i;
+
+	buf[0] = 0x67452301;
+	buf[1] = 0xefcdab89;
+	buf[2] = 0x98badcfe;
+	buf[3] = 0x10325476;
+	for (i = 0; i < 4; i++) {
+		if (sb.s_hash_seed[i]) {
+			memcpy(buf, sb.s_hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (version) {
+	case EXT2_HASH_LEGACY_UNSIGNED:
+		uns = 1;
+		/* fall through */
+	case EXT2_HASH_LEGACY:
+		for (i = 0; i < len; i++) {
+			h = h1 + (h0 ^ (DX_CHAR(name, i, uns) * 7152373));
+			if (h & 0x80000000)
+				h -= 0x7fffffff;
+			h1 = h0;
+			h0 = h;
+		}
+		h = h0 << 1;
+		break;
+
+	case EXT2_HASH_HALF_MD4_UNSIGNED:
+		uns = 1;
+		/* fall through */
+	case EXT2_HASH_HALF_MD4:
+		for (i = 0; i < len; i += 32) {
+			dx_str2hashbuf(name + i, len - i, in, 8, uns);
+			dx_half_md4(buf, in);
+		}
+		h = buf[1];
+		break;
+
+	case EXT2_HASH_TEA_UNSIGNED:
+		uns = 1;
+		/* fall through */
+	case EXT2_HASH_TEA:
+		for (i = 0; i < len; i += 16) {
+			dx_str2hashbuf(name + i, len - i, in, 4, uns);
+			dx_tea(buf, in);
+		}
+		h = buf[0];
+		break;
+
+	default:
+		return -1;
+	}
+	h &= ~1;
+	if (h == (DX_HASH_EOF << 1))
+		h = (DX_HASH_EOF - 1) << 1;
+	*hash = h;
+	return 0;
+}
+
+/*
+ * Search the directory block in blkbuf for NAME[0..LEN-1].  Returns
+ * its inode number, 0 if it isn't there, or -1 if the block is corrupt.
+ */
+static int dx_search_leaf(const char *name, int len)
+{
+	struct ext2_dir_entry_2 *dp;
+	int offset;
+
+	for (offset = 0; offset < ext2fs.blocksize; offset += dp->rec_len) {
+		dp = (struct ext2_dir_entry_2 *) (blkbuf + offset);
+		if (dp->rec_len < 8 || dp->rec_len & 3
+		    || dp->rec_len > ext2fs.blocksize - offset)
+			return -1;
+		if (dp->inode && dp->name_len == len
+		    && strncmp(name, dp->name, len) == 0)
+			return dp->inode;
+	}
+	return 0;
+}
+
+/*
+ * Look up NAME[0..LEN-1] through the hash index of DIR_INODE.
+ * Returns its inode number, 0 if it isn't in the directory, or -1 if
+ * the directory has no usable index and must be scanned instead.
+ */
+static int ext2_dx_lookup(struct ext2_inode *dir_inode, const char *name,
+			  int len)
+{
+	struct ext2_dx_root_info *info;
+	struct ext2_dx_countlimit *cl;
+	struct ext2_dx_entry *entries, *at;
+	unsigned int hash, next_hash = 0, block = 0;
+	int version, levels, level, limit, lo, hi, mid, ino;
+	char *node;
+
+	if (!(sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+	    || !(dir_inode->i_flags & EXT2_INDEX_FL))
+		return -1;
+
+	if (extn_breadi(dir_inode, 0, 1, blkbuf) < 0)
+		return -1;
+	/* "." takes the first 12 bytes, ".." the rest of the block */
+	info = (struct ext2_dx_root_info *) (blkbuf + 24);
+	version = info->hash_version;
+	if (version <= EXT2_HASH_TEA
+	    && (sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+		version += EXT2_HASH_LEGACY_UNSIGNED;
+	levels = info->indirect_levels + 1;
+	if (((struct ext2_dir_entry_2 *) blkbuf)->rec_len != 12
+	    || info->reserved_zero || info->info_length != sizeof(*info)
+	    || levels > DX_MAX_LEVELS
+	    || dx_hash(version, name, len, &hash) < 0)
+	{
+#ifdef DEBUG_EXT2
+		printf("ext2_dx_lookup: unusable index, scanning\n");
+#endif
+		return -1;
+	}
+
+	node = blkbuf + 24 + sizeof(*info);
+	limit = (ext2fs.blocksize - (node - blkbuf)) / sizeof(*entries);
+	for (level = 0; level < levels; ++level) {
+		entries = (struct ext2_dx_entry *) node;
+		cl = (struct ext2_dx_countlimit *) node;
+		if (cl->count == 0 || cl->count > cl->limit
+		    || cl->limit > limit)
+			return -1;
+
+		/* last entry whose hash is <= ours; entry 0 has none */
+		lo = 0;
+		hi = cl->count - 1;
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if (entries[mid].hash <= hash)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		at = &entries[lo];
+		if (lo + 1 < cl->count)
+			next_hash = entries[lo + 1].hash;
+		block = at->block & 0x0fffffff;
+		if (block == 0 || block >= dir_inode->i_size / ext2fs.blocksize)
+			return -1;
+
+		if (extn_breadi(dir_inode, block, 1, blkbuf) < 0)
+			return -1;
+		/* interior nodes start with an empty dirent */
+		node = blkbuf + 8;
+		limit = (ext2fs.blocksize - 8) / sizeof(*entries);
+	}
+
+	ino = dx_search_leaf(name, len);
+	/*
+	 * Names with the same hash can spill into the next leaf, which
+	 * then starts at hash | 1.  That is rare enough to just scan the
+	 * whole directory.
+	 */
+	if (ino < 0 || (ino == 0 && next_hash == (hash | 1)))
+		return -1;
+#ifdef DEBUG_EXT2
+	printf("ext2_dx_lookup: %.*s is %d, from leaf %u\n", len, name,
+	       ino, block);
+#endif
+	return ino;
+}
+
+/*
+ * Search directory DIR_INODE for NAME[0..LEN-1].  Returns its inode
+ * number or -1 if it isn't there.
+ */
+static int ext2_lookup(struct ext2_inode *dir_inode, const char *name,
+		       int len)
+{
+	struct inode_table_entry *itp = (struct inode_table_entry *)dir_inode;
+	struct ext2_dir_entry_2 *dp;
+	unsigned long ino;
+	int rewind = 0, next;
+
+	if (dcache_lookup(itp->inumber, name, len, &ino))
+		return ino ? (int) ino : -1;
+
+	next = ext2_dx_lookup(dir_inode, name, len);
+	if (next >= 0) {
+		dcache_enter(itp->inumber, name, len, next);
+		return next ? next : -1;
+	}
+
+	/* rewind the first time through */
+	while ((dp = ext2_readdiri(dir_inode, !rewind++))) {
+		if ((dp->name_len == len) &&
+		    (strncmp(name, dp->name, len) == 0))
+		{
+			/* Found it! */
+#ifdef DEBUG_EXT2
+			printf("ext2_lookup: found entry %.*s\n", len, name);
+#endif
+			dcache_enter(itp->inumber, name, len, dp->inode);
+			return dp->inode;
+		}
+#ifdef DEBUG_EXT2
+		printf("ext2_lookup: looping\n");
+#endif
+	}
+	dcache_enter(itp->inumber, name, len, 0);
+	return -1;
+}
+
 static struct ext2_inode *ext2_namei(const char *name)
 {
 	char namebuf[256];
 	char *component;
 	struct ext2_inode *dir_inode;
-	struct ext2_dir_entry_2 *dp;
 	int next_ino;
 
 	/* squirrel away a copy of "namebuf" that we can modify: */
 	strcpy(namebuf, name);
 
-	/* start at the root: */
+	/*
+	 * start at the root, with a reference of our own: root_inode
+	 * holds one for good, so its slot is never reused.
+	 */
 	if (!root_inode)
 		root_inode = ext2_iget(EXT2_ROOT_INO);
-	dir_inode = root_inode;
+	if (!root_inode)
+	  return NULL;
+	dir_inode = ext2_iget(EXT2_ROOT_INO);
 	if (!dir_inode)
 	  return NULL;
 
 	component = strtok(namebuf, "/");
 	while (component) {
-		int component_length;
-		int rewind = 0;
 		/*
 		 * Search for the specified component in the current
 		 * directory inode.
 		 */
-		next_ino = -1;
-		component_length = strlen(component);
-
-		/* rewind the first time through */
-		while ((dp = ext2_readdiri(dir_inode, !rewind++))) {
-			if ((dp->name_len == component_length) &&
-			    (strncmp(component, dp->name,
-				     component_length) == 0))
-			{
-				/* Found it! */
-#ifdef DEBUG_EXT2
-				printf("ext2_namei: found entry %s\n",
-					component);
-#endif
-				next_ino = dp->inode;
-				break;
-			}
-#ifdef DEBUG_EXT2
-			printf("ext2_namei: looping\n");
-#endif
-		}
+		next_ino = ext2_lookup(dir_inode, component,
+				       strlen(component));
 
 #ifdef DEBUG_EXT2
 		printf("ext2_namei: next_ino = %d\n", next_ino);
@@ -501,8 +1349,7 @@ static struct ext2_inode *ext2_namei(const char *name)
 		 * At this point, we're done with this directory whether
 		 * we've succeeded or failed...
 		 */
-		if (dir_inode != root_inode)
-			ext2_iput(dir_inode);
+		ext2_iput(dir_inode);
 
 		/*
 		 * If next_ino is negative, then we've failed (gone
@@ -577,7 +1424,7 @@ static int ext2_fstat(int fd, struct stat* buf)
 	buf->st_nlink = ip->i_links_count;
 	buf->st_uid = ip->i_uid;
 	buf->st_gid = ip->i_gid;
-	buf->st_size = ip->i_size;
+	buf->st_size = ext2_isize(ip);
 	buf->st_blocks = ip->i_blocks;
 	buf->st_atime = ip->i_atime;
 	buf->st_mtime = ip->i_mtime;
@@ -639,10 +1486,18 @@ static int ext2_open(const char *filename)
 		struct inode_table_entry *itp;
 
 		while (S_ISLNK(ip->i_mode)) {
-			ip = ext2_follow_link(ip, filename);
+			struct ext2_inode *link = ip;
+
+			ip = ext2_follow_link(link, filename);
+			/* done with the link itself, don't leak its slot */
+			ext2_iput(link);
 			if (!ip) return -1;
 		}
 		itp = (struct inode_table_entry *)ip;
+		/* a cached inode may still have its block map */
+		if (S_ISREG(ip->i_mode) && !(ip->i_flags & EXT4_EXTENTS_FL)
+		    && !itp->nruns)
+			ext2_build_runs(itp);
 		return itp - inode_table;
 	} else
 		return -1;
@@ -651,9 +1506,7 @@ static int ext2_open(const char *filename)
 
 static void ext2_close(int fd)
 {
-	/* blah, hack, don't close the root inode ever */
-	if (&inode_table[fd].inode != root_inode)
-		ext2_iput(&inode_table[fd].inode);
+	ext2_iput(&inode_table[fd].inode);
 }
 
 struct bootfs ext2fs = {
@@ -8,6 +8,7 @@
  */
 #include <stdlib.h>
 
+#include <aboot.h>
 #include <cons.h>
 #include <bootfs.h>
 #include <isolib.h>
@@ -33,6 +34,9 @@ iso_mount (long cons_dev, long p_offset, long quiet)
 	printf("iso_mount() called\n");
 #endif
 	cd_device = cons_dev;
+	iso_dcache_lookup = dcache_lookup;
+	iso_dcache_enter = dcache_enter;
+	iso_inflate = inflate_buffer;
 	/*
 	 * Read the super block (this determines the file system type
 	 * and other important information)
@@ -182,13 +182,13 @@ static daddr_t block_map(struct file *fp, daddr_t file_block)
 		}
 
 		if (fp->f_blkno[level] != ind_block_num) {
-			if (fp->f_blk[level]) {
-				free(fp->f_blk[level]);
+			/* one buffer per level, reused for each block */
+			if (!fp->f_blk[level]) {
+				fp->f_blk[level] = malloc(fs->fs_bsize);
 			}
 
 			offset = fsbtodb(fs, ind_block_num) * DEV_BSIZE
 			  + partition_offset;
-			fp->f_blk[level] = malloc(fs->fs_bsize);
 			if (cons_read(dev, fp->f_blk[level], fs->fs_bsize,
 				      offset)
 			    != fs->fs_bsize)
@@ -254,16 +254,25 @@ static int breadi(struct file *fp, long blkno, long nblks, char *buffer)
 
 
 /*
- * Search a directory for a name and return its
- * i_number.
+ * Search a directory for a name and return its i_number: FP is the
+ * directory, whose inode number is in *INUMBER_P on entry.  On success
+ * *INUMBER_P is set to the inode of NAME.
  */
 static int search_dir(const char *name, struct file *fp, ino_t *inumber_p)
 {
 	long offset, blockoffset;
 	struct direct *dp;
+	unsigned long ino;
 	int len;
 
 	len = strlen(name);
+	if (dcache_lookup(*inumber_p, name, len, &ino)) {
+		if (!ino) {
+			return -1;
+		}
+		*inumber_p = ino;
+		return 0;
+	}
 
 	offset = 0;
 	while (offset < fp->i_size) {
@@ -278,6 +287,8 @@ static int search_dir(const char *name, struct file *fp, ino_t *inumber_p)
 				    && strcmp(name, dp->d_name) == 0)
 				{
 					/* found entry */
+					dcache_enter(*inumber_p, name, len,
+						     dp->d_ino);
 					*inumber_p = dp->d_ino;
 					return 0;
 				}
@@ -286,6 +297,7 @@ static int search_dir(const char *name, struct file *fp, ino_t *inumber_p)
 		}
 		offset += fs->fs_bsize;
 	}
+	dcache_enter(*inumber_p, name, len, 0);
 	return -1;
 }
 
@@ -58,6 +58,17 @@ int vsprintf(char *, const char *, va_list);
 unsigned long simple_strtoul(const char *cp, char **endp, unsigned int base);
 
 /* From zip/misc.c */
+struct decompressor {
+	const char *	name;
+	const char *	magic;		/* leading bytes of the file */
+	int		magic_len;
+	int		(*load)(int fd);
+};
+
 int uncompress_kernel(int fd);
+const struct decompressor *find_decompressor(const unsigned char *buf,
+					     long len);
+long inflate_buffer(const unsigned char *src, long srclen,
+		   unsigned char *dst, long dstlen);
 
 #endif /* aboot_h */
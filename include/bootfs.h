@@ -21,4 +21,13 @@ struct bootfs {
 	int	(*fstat)(int fd, struct stat* buf);
 };
 
+/* From readahead.c */
+const struct bootfs *readahead_fs(const struct bootfs *fs);
+
+/* From disk.c */
+int	dcache_lookup(unsigned long dir, const char *name, int len,
+		      unsigned long *ino);
+void	dcache_enter(unsigned long dir, const char *name, int len,
+		     unsigned long ino);
+
 #endif /* boot_fs_h */
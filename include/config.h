@@ -9,4 +9,10 @@
 #define CONFIG_FILE_PARTITION	1
 #define CONFIG_FILE		"/etc/aboot.conf"
 
+/* largest window the sequential read-ahead in readahead.c grows to */
+#define READAHEAD_MAX		(2*1024*1024)
+
+/* largest LZMA dictionary zip/unxz.c allocates */
+#define XZ_DICT_MAX		(64*1024*1024)
+
 #endif /* config_h */
@@ -23,6 +23,9 @@ long cons_puts(const char *str, long len);
 long cons_open(const char *devname);
 long cons_close(long dev);
 long cons_read(long dev, void *buf, long count, long offset);
+extern long cons_cache_hits;	/* cons_read()s served from the cache */
+extern long cons_cache_misses;	/* cons_read()s that missed the cache */
+extern long cons_bounce_reads;	/* sectors bounced for unaligned reads */
 void cons_putchar(char c);
 int cons_getchar(void);
 void cons_open_console(void);
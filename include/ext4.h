@@ -66,4 +66,12 @@ struct ext4_extent_header {
 
 #define EXT4_EXT_MAGIC	0xf30a
 
+/*
+ * ee_len values above EXT_INIT_MAX_LEN mark an unwritten extent of
+ * (ee_len - EXT_INIT_MAX_LEN) blocks.
+ */
+#define EXT_INIT_MAX_LEN	(1UL << 15)
+
+#define EXT4_EXT_MAX_DEPTH	5	/* deepest tree we will walk */
+
 #endif
@@ -250,6 +250,13 @@ struct RR_TF{
   struct stamp times[0];  /* Variable number of these beasts */
 };
 
+/* zisofs compressed file (mkzftree), from Linux 2.4 */
+struct RR_ZF{
+  char algorithm[2];		/* "pz" */
+  unsigned char parms[2];	/* header size / 4, log2 of the block size */
+  char real_size[8];
+};
+
 /* These are the bits and their meanings for flags in the TF structure. */
 #define TF_CREATE 1
 #define TF_MODIFY 2
@@ -276,6 +283,7 @@ struct rock_ridge{
     struct RR_CL CL;
     struct RR_PL PL;
     struct RR_TF TF;
+    struct RR_ZF ZF;
   } u;
 };
 
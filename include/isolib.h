@@ -17,6 +17,16 @@ int  isonum_731 (char *p);
 int  isonum_732 (char *p);
 int  isonum_733 (char *p);
 
+/* optional directory lookup cache, see dcache_lookup() in disk.c */
+extern int  (*iso_dcache_lookup) (unsigned long dir, const char *name,
+				  int len, unsigned long *ino);
+extern void (*iso_dcache_enter) (unsigned long dir, const char *name,
+				 int len, unsigned long ino);
+
+/* inflates zisofs blocks, see inflate_buffer() in zip/misc.c */
+extern long (*iso_inflate) (const unsigned char *src, long srclen,
+			    unsigned char *dst, long dstlen);
+
 #endif /* isolib_h */
 
 
@@ -0,0 +1,26 @@
+#ifndef prof_h
+#define prof_h
+
+/*
+ * Boot phases timed by prof.c.  Phases nest: time spent in an inner
+ * phase is not charged to the phase around it.
+ */
+enum prof_phase {
+	PROF_CONS_INIT,
+	PROF_DISKLABEL,
+	PROF_MOUNT,
+	PROF_NAMEI,
+	PROF_KERNEL_READ,
+	PROF_DECOMPRESS,
+	PROF_CRC,
+	PROF_BSS,
+	PROF_INITRD,
+	PROF_NPHASES
+};
+
+void	prof_start(int phase);
+void	prof_stop(int phase);
+void	prof_io(long nbytes);
+void	prof_report(void);
+
+#endif /* prof_h */
@@ -5,16 +5,34 @@
 
 #include "hwrpb.h"
 
+/*
+ * A scope of heap allocations; see arena_enter() in utils.c.
+ */
+struct arena {
+	const char *	name;
+	int		depth;
+	unsigned long	id;		/* 0 if not tracked */
+};
+
 #ifdef TESTING
 #define pal_init()
+#define arena_enter(a, name)	((void) (a))
+#define arena_leave(a)		((void) (a))
+#define arena_live(a)		((void) (a), 1)
+#define heap_report()
 #else
 int		printf (const char *fmt, ...);
-struct pcb_struct *find_pa (unsigned long vptb, struct pcb_struct *pcb);
+struct pcb_struct *find_pa (unsigned long *vptb, struct pcb_struct *pcb);
 void		pal_init (void);
 
 void *		malloc (size_t size);
 void		free (void *ptr);
 void		getline (char *buf, int maxlen);
+
+void		arena_enter (struct arena *a, const char *name);
+void		arena_leave (struct arena *a);
+int		arena_live (const struct arena *a);
+void		heap_report (void);
 #endif
 
 int		check_memory(unsigned long, unsigned long);
@@ -27,12 +27,98 @@ static struct inode_table_entry {
     int nlink;
     int mode;
     void *start;
+    /* zisofs compressed files, see iso_zf_breadi() */
+    unsigned char zf_shift;	/* log2 of the block size, 0 if not compressed */
+    unsigned char zf_header;	/* header size / 4 */
+    unsigned zf_size;		/* uncompressed size, from the ZF entry */
+    unsigned zf_csize;		/* size on disc */
+    unsigned *zf_ptrs;		/* block pointers, read on first use */
+    char *zf_buf;		/* a block, decompressed */
+    long zf_block;		/* block in zf_buf, -1 if none */
 } inode_table[MAX_OPEN_FILES];
 
 static unsigned long root_inode = 0;
 static struct isofs_super_block sb;
-static char data_block[1024];
-static char big_data_block[2048];
+static char data_block[ISOFS_BLOCK_SIZE];
+
+/*
+ * The L-type path table, read at mount time.  It lists every directory
+ * with its extent and the number of its parent (records are numbered
+ * from 1, the root), so leading path components can be resolved
+ * without reading any directories.
+ */
+#define MAX_PATH_TABLE	(256*1024)
+
+static char *path_table;
+static int *pt_offset;		/* record N starts at path_table[pt_offset[N-1]] */
+static int pt_count;
+
+/*
+ * Directories are read whole (their extents are contiguous) and kept
+ * with their records already parsed, Rock Ridge names included, so
+ * lookups, listings and iso_iget() of their entries read nothing more.
+ */
+#define DIR_CACHE_SLOTS	4
+#define MAX_DIR_SIZE	(1024*1024)
+
+struct iso_dir_entry {
+    unsigned int ino;		/* byte offset of the record */
+    int name;			/* offset of the name in names */
+    unsigned char name_len;
+    unsigned char flags;	/* record flags */
+    unsigned char kind;		/* DE_FILE, DE_DOT or DE_DOTDOT */
+    unsigned char opt_dot;	/* a '.' mapped from ".;1" was dropped */
+    /* Rock Ridge attributes, as parse_rock_ridge_inode() found them */
+    int rr_mode;		/* PX mode, 0 if none */
+    int rr_nlink;
+    int link;			/* symlink target in names, -1 if none */
+    int link_len;
+    unsigned char zf_shift;	/* ZF parameters, zf_shift 0 if none */
+    unsigned char zf_header;
+    unsigned int zf_size;
+};
+
+#define DE_FILE		0
+#define DE_DOT		1
+#define DE_DOTDOT	2
+
+static struct iso_dir_cache {
+    unsigned long dir;		/* i_first_extent, 0 if unused */
+    char *raw;			/* the records as read */
+    int raw_size, raw_max;
+    struct iso_dir_entry *ents;
+    int nents, ents_max;
+    char *names;		/* NUL-terminated names */
+    int names_max;
+} dir_cache[DIR_CACHE_SLOTS];
+static int dir_cache_next;	/* slot replaced next */
+
+static unsigned char *iso_dir_record (unsigned long ino,
+				      struct iso_dir_entry **entp);
+
+/*
+ * Rock Ridge continuation areas, a sector each.  Names, attributes and
+ * symlinks of neighbouring entries usually continue in the same one.
+ */
+#define CE_CACHE_SLOTS	4
+
+static char ce_cache[CE_CACHE_SLOTS][ISOFS_BLOCK_SIZE];
+static int ce_extent[CE_CACHE_SLOTS];	/* 0 if unused */
+static int ce_next;			/* slot replaced next */
+
+/*
+ * Compressed zisofs blocks are read here to be inflated.  Allocated
+ * at mount time for the largest block accepted (twice the 128KB block
+ * size), so that it lives in the mount's arena rather than in
+ * whichever arena the first read of a compressed file happens in.
+ */
+#define ZF_IN_SIZE	(2L << 17)
+
+static char *zf_in;
+
+static const unsigned char zisofs_magic[8] = {
+	0x37, 0xe4, 0x53, 0x96, 0xc9, 0xdb, 0xd6, 0x07
+};
 
 #ifndef S_IRWXUGO
 # define S_IRWXUGO	(S_IRWXU|S_IRWXG|S_IRWXO)
@@ -42,9 +128,18 @@ static char big_data_block[2048];
 
 extern long iso_dev_read (void * buf, long offset, long size);
 
+int  (*iso_dcache_lookup) (unsigned long dir, const char *name,
+			   int len, unsigned long *ino);
+void (*iso_dcache_enter) (unsigned long dir, const char *name,
+			  int len, unsigned long ino);
+long (*iso_inflate) (const unsigned char *src, long srclen,
+		     unsigned char *dst, long dstlen);
+
 static int parse_rock_ridge_inode(struct iso_directory_record * de,
 				  struct iso_inode * inode);
 static char *get_rock_ridge_symlink(struct iso_inode *inode);
+static char *parse_rock_ridge_symlink(struct iso_directory_record *raw_inode,
+				      int size);
 static int get_rock_ridge_filename(struct iso_directory_record * de,
 				   char * retname,
 				   struct iso_inode * inode);
@@ -125,6 +220,134 @@ iso_bmap (struct iso_inode *inode, int block)
 	return (inode->i_first_extent >> sb.s_blocksize_bits) + block;
 }
 
+/*
+ * Read the header and block pointers of a zisofs compressed file.
+ */
+static int
+iso_zf_open (struct inode_table_entry *itp)
+{
+	unsigned char *hdr;
+	long nblocks, len, i;
+
+	nblocks = ((long) itp->size + (1L << itp->zf_shift) - 1)
+		>> itp->zf_shift;
+	len = itp->zf_header * 4 + (nblocks + 1) * 4;
+	hdr = malloc(len);
+	itp->zf_ptrs = malloc((nblocks + 1) * sizeof(unsigned));
+	itp->zf_buf = malloc(1L << itp->zf_shift);
+	if (!hdr || !itp->zf_ptrs || !itp->zf_buf)
+		goto fail;
+	if (len > itp->zf_csize
+	    || iso_dev_read(hdr, itp->inode.i_first_extent, len) != len
+	    || memcmp(hdr, zisofs_magic, sizeof(zisofs_magic)) != 0)
+	{
+		printf("iso9660: bad zisofs header\n");
+		goto fail;
+	}
+	for (i = 0; i <= nblocks; i++)
+		itp->zf_ptrs[i] = isonum_731((char *) hdr + itp->zf_header * 4
+					     + i * 4);
+	free(hdr);
+	itp->zf_block = -1;
+	return 0;
+
+ fail:
+	free(hdr);
+	itp->zf_ptrs = NULL;
+	return -1;
+}
+
+/*
+ * Inflate block ZB of zisofs file ITP, LEN bytes, into DST, which has
+ * room for a whole block.  Blocks stored with no data are zeroes.
+ */
+static int
+iso_zf_block (struct inode_table_entry *itp, long zb, char *dst, long len)
+{
+	unsigned start = itp->zf_ptrs[zb], end = itp->zf_ptrs[zb + 1];
+	long clen = (long) end - start;
+
+	if (clen == 0) {
+		memset(dst, 0, len);
+		return 0;
+	}
+	if (clen < 0 || end > itp->zf_csize || clen > 2L << itp->zf_shift)
+		goto bad;
+	if (!zf_in)
+		return -1;
+	if (iso_dev_read(zf_in, itp->inode.i_first_extent + start, clen)
+	    != clen)
+		return -1;
+	if ((*iso_inflate)((unsigned char *) zf_in, clen,
+			   (unsigned char *) dst, 1L << itp->zf_shift) != len)
+		goto bad;
+	return 0;
+
+ bad:
+	printf("iso9660: bad zisofs block %ld\n", zb);
+	return -1;
+}
+
+/*
+ * iso_breadi() for zisofs compressed files.  Blocks wanted whole are
+ * inflated straight into BUFFER, the others go through zf_buf, which
+ * keeps the last one for the reads that follow.
+ */
+static int
+iso_zf_breadi (struct inode_table_entry *itp, long blkno, long nblks,
+	       char *buffer)
+{
+	long bsize = 1L << itp->zf_shift;
+	long pos, end, zb, off, len, n;
+
+	if (!iso_inflate) {
+		printf("iso9660: can't read zisofs compressed files\n");
+		return -1;
+	}
+	if (!itp->zf_ptrs && iso_zf_open(itp) < 0)
+		return -1;
+
+	/* as for plain files, stop after the block holding EOF */
+	if ((blkno+nblks) * sb.s_blocksize > itp->size)
+		nblks = ((itp->size + sb.s_blocksize)
+			 / sb.s_blocksize) - blkno;
+	if (nblks <= 0)
+		return 0;
+
+	pos = blkno * sb.s_blocksize;
+	end = pos + nblks * sb.s_blocksize;
+	while (pos < end) {
+		if (pos >= itp->size) {
+			memset(buffer, 0, end - pos);
+			break;
+		}
+		zb = pos >> itp->zf_shift;
+		off = pos & (bsize - 1);
+		len = itp->size - (zb << itp->zf_shift);
+		if (len > bsize)
+			len = bsize;
+		n = len - off;
+		if (n > end - pos)
+			n = end - pos;
+
+		if (n == bsize && zb != itp->zf_block) {
+			if (iso_zf_block(itp, zb, buffer, bsize) < 0)
+				return -1;
+		} else {
+			if (zb != itp->zf_block) {
+				itp->zf_block = -1;
+				if (iso_zf_block(itp, zb, itp->zf_buf, len) < 0)
+					return -1;
+				itp->zf_block = zb;
+			}
+			memcpy(buffer, itp->zf_buf + off, n);
+		}
+		buffer += n;
+		pos += n;
+	}
+	return nblks * sb.s_blocksize;
+}
+
 static int
 iso_breadi (struct iso_inode *ip, long blkno, long nblks, char * buffer)
 {
@@ -134,6 +357,10 @@ iso_breadi (struct iso_inode *ip, long blkno, long nblks, char * buffer)
 	if (!ip || !ip->i_first_extent)
 		return -1;
 
+	if (((struct inode_table_entry *) ip)->zf_shift)
+		return iso_zf_breadi((struct inode_table_entry *) ip,
+				     blkno, nblks, buffer);
+
 	i_size = ((struct inode_table_entry *) ip)->size;
 	/* as in ext2.c - cons_read() doesn't really cope well with
            EOF conditions - actually it should be fixed */
@@ -180,8 +407,8 @@ iso_iget (int ino)
 	struct iso_inode *inode;
 	struct inode_table_entry *itp;
 	struct iso_directory_record * raw_inode;
+	struct iso_dir_entry *ent = NULL;
 	unsigned char *pnt = NULL;
-	void *cpnt = NULL;
 	int high_sierra;
 	int block;
 
@@ -204,37 +431,24 @@ iso_iget (int ino)
 		return (NULL);
 	}
 
-	block = ino >> sb.s_blocksize_bits;
-	if (iso_dev_read(data_block, block * sb.s_blocksize, sb.s_blocksize)
-	    != sb.s_blocksize) {
+	high_sierra = sb.s_high_sierra;
+
+	/*
+	 * Usually the directory it is in was just searched.  Otherwise
+	 * read the whole 2048 byte sector holding the record: records
+	 * never cross one, and that is what the drive reads anyway.
+	 */
+	pnt = iso_dir_record(ino, &ent);
+	block = ino >> ISOFS_BLOCK_BITS;
+	if (!pnt && iso_dev_read(data_block, (long) block << ISOFS_BLOCK_BITS,
+				 ISOFS_BLOCK_SIZE) != ISOFS_BLOCK_SIZE) {
 		printf("iso9660: unable to read i-node block");
 		return NULL;
 	}
-
-	pnt = ((unsigned char *) data_block + (ino & (sb.s_blocksize - 1)));
+	if (!pnt)
+		pnt = ((unsigned char *) data_block
+		       + (ino & (ISOFS_BLOCK_SIZE - 1)));
 	raw_inode = ((struct iso_directory_record *) pnt);
-	high_sierra = sb.s_high_sierra;
-
-	if ((ino & (sb.s_blocksize - 1)) + *pnt > sb.s_blocksize){
-		int frag1, offset;
-
-		offset = (ino & (sb.s_blocksize - 1));
-		frag1 = sb.s_blocksize - offset;
-		cpnt = big_data_block;
-		memcpy(cpnt, data_block + offset, frag1);
-		offset += *pnt - sb.s_blocksize; /* DUH! pnt would get
-                                                    wiped out by the
-                                                    iso_dev_read here. */
-		if (iso_dev_read(data_block, ++block * sb.s_blocksize,
-				 sb.s_blocksize)
-		    != sb.s_blocksize) {
-			printf("unable to read i-node block");
-			return NULL;
-		}
-		memcpy((char *)cpnt+frag1, data_block, offset);
-		pnt = ((unsigned char *) cpnt);
-		raw_inode = ((struct iso_directory_record *) pnt);
-	}
 
 	if (raw_inode->flags[-high_sierra] & 2) {
 		itp->mode = S_IRUGO | S_IXUGO | S_IFDIR;
@@ -308,9 +522,35 @@ iso_iget (int ino)
 
 	/* Now we check the Rock Ridge extensions for further info */
 
-	if (sb.s_rock)
+	itp->zf_shift = 0;
+	itp->zf_ptrs = NULL;
+	if (sb.s_rock && ent) {
+		/* parsed along with its directory */
+		if (ent->rr_mode) {
+			itp->mode = ent->rr_mode;
+			itp->nlink = ent->rr_nlink;
+		}
+		if (ent->link >= 0)
+			itp->size = ent->link_len;
+		itp->zf_shift = ent->zf_shift;
+		itp->zf_header = ent->zf_header;
+		itp->zf_size = ent->zf_size;
+	} else if (sb.s_rock)
 		parse_rock_ridge_inode(raw_inode,inode);
 
+	/* zisofs: reads get inflated, and the size is what they yield */
+	if (itp->zf_shift) {
+		if (!S_ISREG(itp->mode) || itp->zf_header < 4
+		    || itp->zf_shift < 15 || itp->zf_shift > 17)
+		{
+			/* its data would be compressed bytes, not the file */
+			printf("iso9660: unsupported zisofs parameters\n");
+			return NULL;
+		}
+		itp->zf_csize = itp->size;
+		itp->size = itp->zf_size;
+	}
+
 	/* Will be used for previous directory */
 	inode->i_backlink = 0xffffffff;
 	switch (sb.s_conversion) {
@@ -373,168 +613,464 @@ iso_match (int len, const char *name, const char *compare, int dlen)
 }
 
 /*
- * Find an entry in the specified directory with the wanted name. It
- * returns the cache buffer in which the entry was found, and the entry
- * itself (as an inode number). It does NOT read the inode of the
- * entry - you'll have to do that yourself if you want to.
- *
- * uses data_block
+ * Return the directory record at byte offset INO if it lies in a
+ * cached directory, else NULL.  If ENTP isn't NULL, *ENTP is set to
+ * the parsed entry of that record, or NULL.
  */
-static int
-iso_find_entry (struct iso_inode *dir, const char *name, int namelen,
-		unsigned long *ino, unsigned long *ino_back)
+static unsigned char *
+iso_dir_record (unsigned long ino, struct iso_dir_entry **entp)
 {
-	unsigned long bufsize = sb.s_blocksize;
-	unsigned char bufbits = sb.s_blocksize_bits;
-	unsigned int block, f_pos, offset, inode_number = 0; /*shut up, gcc*/
-	void * cpnt = NULL;
-	unsigned int old_offset;
-	unsigned int backlink;
-	int dlen, match, i;
-	struct iso_directory_record * de;
-	char c;
-	struct inode_table_entry *itp = (struct inode_table_entry *) dir;
-
-	*ino = 0;
-	if (!dir) return -1;
-
-	if (!(block = dir->i_first_extent)) return -1;
+	struct iso_dir_cache *dc;
+	struct iso_dir_entry *ent;
+	unsigned long off;
+
+	if (entp)
+		*entp = NULL;
+	for (dc = dir_cache; dc < dir_cache + DIR_CACHE_SLOTS; dc++) {
+		if (!dc->dir || ino < dc->dir)
+			continue;
+		off = ino - dc->dir;
+		if (off >= (unsigned long) dc->raw_size
+		    || off + *(unsigned char *) (dc->raw + off)
+		       > (unsigned long) dc->raw_size)
+			continue;
+		for (ent = dc->ents; entp && ent < dc->ents + dc->nents;
+		     ent++) {
+			if (ent->ino == ino && ent->kind != DE_DOTDOT) {
+				*entp = ent;
+				break;
+			}
+		}
+		return (unsigned char *) dc->raw + off;
+	}
+	return NULL;
+}
 
-	f_pos = 0;
-	offset = 0;
-	block = iso_bmap(dir,f_pos >> bufbits);
-	if (!block) return -1;
 
-	if (iso_dev_read(data_block, block * sb.s_blocksize, sb.s_blocksize)
-	    != sb.s_blocksize) return -1;
+/*
+ * Parse the records in DC->raw into DC->ents and DC->names.  Returns
+ * 0 on success, or the number of name bytes needed if DC->names is too
+ * small.
+ */
+static int
+iso_dir_parse (struct iso_dir_cache *dc, struct iso_inode *dir)
+{
+	struct iso_directory_record *de;
+	struct iso_dir_entry *ent;
+	struct inode_table_entry attr;
+	/* should be sufficient, since get_rock_ridge_filename
+	 * truncates at 254 chars */
+	char retname[256];
+	char *name, *link;
+	int pos, len, dlen, used = 0, i;
+	char c;
 
-	while (f_pos < itp->size) {
-		de = (struct iso_directory_record *) (data_block + offset);
-		backlink = itp->inumber;
-		inode_number = (block << bufbits) + (offset & (bufsize - 1));
+	dc->nents = 0;
+	for (pos = 0; pos < dc->raw_size; pos += len) {
+		de = (struct iso_directory_record *) (dc->raw + pos);
+		len = isonum_711(de->length);
 
 		/* If byte is zero, this is the end of file, or time to move to
-		   the next sector. Usually 2048 byte boundaries. */
-
-		if (*((unsigned char *) de) == 0) {
-			offset = 0;
-
-			/* round f_pos up to the nearest blocksize */
-			f_pos = ((f_pos & ~(ISOFS_BLOCK_SIZE - 1))
-				 + ISOFS_BLOCK_SIZE);
-			block = iso_bmap(dir,f_pos>>bufbits);
-			if (!block) return -1;
-			if (iso_dev_read(data_block,
-					 block * sb.s_blocksize,
-					 sb.s_blocksize)
-				!= sb.s_blocksize) return -1;
-  			continue; /* Will kick out if past end of directory */
+		   the next sector. */
+		if (len == 0) {
+			len = ISOFS_BLOCK_SIZE - (pos & (ISOFS_BLOCK_SIZE - 1));
+			continue;
 		}
-
-		old_offset = offset;
-		offset += *((unsigned char *) de);
-		f_pos += *((unsigned char *) de);
-
-		/* Handle case where the directory entry spans two blocks.
-		   Usually 1024 byte boundaries */
-		if (offset >= bufsize) {
-		        unsigned int frag1;
-			frag1 = bufsize - old_offset;
-			cpnt = big_data_block;
-			memcpy(cpnt, data_block + old_offset, frag1);
-
-			de = (struct iso_directory_record *) cpnt;
-			offset = f_pos & (bufsize - 1);
-			block = iso_bmap(dir,f_pos>>bufbits);
-			if (!block) return -1;
-                        if (iso_dev_read(data_block,
-					 block * sb.s_blocksize,
-					 sb.s_blocksize)
-				!= sb.s_blocksize) return 0;
-			memcpy((char *)cpnt+frag1, data_block, offset);
+		if (len < (int) sizeof(*de) || pos + len > dc->raw_size
+		    || sizeof(*de) + de->name_len[0] > (unsigned) len
+		    || dc->nents == dc->ents_max)
+		{
+			printf("iso9660: bad directory record at %lu\n",
+			       dc->dir + pos);
+			break;
 		}
 
-		/* Handle the '.' case */
-
-		if (de->name[0]==0 && de->name_len[0]==1) {
-		  inode_number = itp->inumber;
-		  backlink = 0;
+		ent = &dc->ents[dc->nents++];
+		ent->ino = dc->dir + pos;
+		ent->flags = de->flags[-sb.s_high_sierra];
+		ent->kind = DE_FILE;
+		ent->opt_dot = 0;
+		ent->rr_mode = 0;
+		ent->link = -1;
+		ent->zf_shift = 0;
+		name = de->name;
+		dlen = de->name_len[0];
+		if (dlen == 1 && de->name[0] == 0) {
+			ent->kind = DE_DOT;
+		} else if (dlen == 1 && de->name[0] == 1) {
+			ent->kind = DE_DOTDOT;
+			ent->ino = (isonum_733(de->extent) +
+				    isonum_711(de->ext_attr_length))
+				<< sb.s_log_zone_size;
+		} else if ((dlen = get_rock_ridge_filename(de, retname, dir))) {
+			name = retname;
+		} else {
+			dlen = de->name_len[0];
 		}
 
-		/* Handle the '..' case */
-
-		if (de->name[0]==1 && de->name_len[0]==1) {
-
-		  if((int) sb.s_firstdatazone != itp->inumber)
-  		    inode_number = (isonum_733(de->extent) +
-			  	    isonum_711(de->ext_attr_length))
-				    << sb.s_log_zone_size;
-		  else
-		    inode_number = itp->inumber;
-		  backlink = 0;
+		ent->name = used;
+		ent->name_len = dlen;
+		used += dlen + 1;
+		if (used <= dc->names_max) {
+			memcpy(dc->names + ent->name, name, dlen);
+			dc->names[ent->name + dlen] = '\0';
 		}
 
-		{
-		  /* should be sufficient, since get_rock_ridge_filename
-		   * truncates at 254 chars */
-		  char retname[256];
-		  dlen = get_rock_ridge_filename(de, retname, dir);
-		  if (dlen) {
-		    strcpy(de->name, retname);
-		  } else {
-		    dlen = isonum_711((char *) de->name_len);
-		    if(sb.s_mapping == 'n') {
-		      for (i = 0; i < dlen; i++) {
-			c = de->name[i];
+		/*
+		 * The rest of the Rock Ridge attributes, so iso_iget()
+		 * and iso_follow_link() needn't parse them again.
+		 */
+		if (sb.s_rock && ent->kind != DE_DOTDOT) {
+			attr.mode = 0;
+			attr.nlink = 1;
+			attr.size = ~0U;	/* unless there's a symlink */
+			attr.inumber = ent->ino;
+			attr.zf_shift = 0;
+			parse_rock_ridge_inode(de, &attr.inode);
+			ent->rr_mode = attr.mode;
+			ent->rr_nlink = attr.nlink;
+			ent->zf_shift = attr.zf_shift;
+			ent->zf_header = attr.zf_header;
+			ent->zf_size = attr.zf_size;
+			if (attr.size != ~0U
+			    && (link = parse_rock_ridge_symlink(de, attr.size)))
+			{
+				ent->link = used;
+				ent->link_len = strlen(link);
+				used += ent->link_len + 1;
+				if (used <= dc->names_max)
+					strcpy(dc->names + ent->link, link);
+				free(link);
+			}
+		}
+		if (used > dc->names_max)
+			continue;	/* just count, the caller grows names */
+
+		if (ent->kind != DE_FILE || name == retname
+		    || sb.s_mapping != 'n')
+			continue;
+		name = dc->names + ent->name;
+		for (i = 0; i < dlen; i++) {
+			c = name[i];
 			if (c >= 'A' && c <= 'Z') c |= 0x20;  /* lower case */
-			if (c == ';' && i == dlen-2
-			    && de->name[i+1] == '1') {
-			  dlen -= 2;
-			  break;
+			if (c == ';' && i == dlen-2 && name[i+1] == '1') {
+				dlen -= 2;
+				break;
 			}
 			if (c == ';') c = '.';
-			de->name[i] = c;
-		      }
-		      /* This allows us to match with and without a trailing
-			 period.  */
-		      if(de->name[dlen-1] == '.' && namelen == dlen-1)
+			name[i] = c;
+		}
+		/* This allows us to match with and without a trailing
+		   period.  */
+		if (dlen > 1 && name[dlen-1] == '.') {
+			ent->opt_dot = 1;
 			dlen--;
-		    }
-		  }
 		}
+		name[dlen] = '\0';
+		ent->name_len = dlen;
+	}
+	return used > dc->names_max ? used : 0;
+}
+
+
+/*
+ * Return the cached directory DIR, reading and parsing it if needed.
+ * Returns NULL if it can't be read.
+ */
+static struct iso_dir_cache *
+iso_dir_load (struct iso_inode *dir)
+{
+	struct inode_table_entry *itp = (struct inode_table_entry *) dir;
+	struct iso_dir_cache *dc;
+	int size, need;
+
+	if (!dir->i_first_extent)
+		return NULL;
+	for (dc = dir_cache; dc < dir_cache + DIR_CACHE_SLOTS; dc++) {
+		if (dc->dir == dir->i_first_extent)
+			return dc;
+	}
+
+	size = (itp->size + ISOFS_BLOCK_SIZE - 1) & ~(ISOFS_BLOCK_SIZE - 1);
+	if (size <= 0 || size > MAX_DIR_SIZE) {
+		printf("iso9660: directory of %u bytes too large\n", itp->size);
+		return NULL;
+	}
+
+	dc = &dir_cache[dir_cache_next];
+	dir_cache_next = (dir_cache_next + 1) % DIR_CACHE_SLOTS;
+	dc->dir = 0;
+	if (size > dc->raw_max) {
+		free(dc->raw);
+		free(dc->ents);
+		dc->raw = malloc(size);
+		/* every record is at least 34 bytes */
+		dc->ents_max = size / sizeof(struct iso_directory_record);
+		dc->ents = malloc(dc->ents_max * sizeof(struct iso_dir_entry));
+		if (!dc->raw || !dc->ents) {
+			dc->raw_max = 0;
+			return NULL;
+		}
+		dc->raw_max = size;
+	}
+#ifdef DEBUG_ISO
+	printf("iso_dir_load: reading %d bytes at %u\n", size,
+	       dir->i_first_extent);
+#endif
+	if (iso_dev_read(dc->raw, dir->i_first_extent, size) != size)
+		return NULL;
+	dc->raw_size = size;
+	dc->dir = dir->i_first_extent;
+
+	while ((need = iso_dir_parse(dc, dir))) {
+		free(dc->names);
+		dc->names = malloc(need);
+		if (!dc->names) {
+			dc->names_max = 0;
+			dc->dir = 0;
+			return NULL;
+		}
+		dc->names_max = need;
+	}
+	return dc;
+}
+
+
+/*
+ * Find an entry in the specified directory with the wanted name. It
+ * returns the entry itself (as an inode number). It does NOT read the
+ * inode of the entry - you'll have to do that yourself if you want to.
+ */
+static int
+iso_find_entry (struct iso_inode *dir, const char *name, int namelen,
+		unsigned long *ino, unsigned long *ino_back)
+{
+	struct inode_table_entry *itp = (struct inode_table_entry *) dir;
+	struct iso_dir_cache *dc;
+	struct iso_dir_entry *ent;
+	unsigned long inode_number, backlink;
+	int len;
+
+	*ino = 0;
+	if (!dir) return -1;
+
+	if (iso_dcache_lookup
+	    && iso_dcache_lookup(itp->inumber, name, namelen, ino))
+	{
+		*ino_back = itp->inumber;
+		return *ino ? 0 : -1;
+	}
+
+	if (!(dc = iso_dir_load(dir))) return -1;
+
+	for (ent = dc->ents; ent < dc->ents + dc->nents; ent++) {
 		/*
 		 * Skip hidden or associated files unless unhide is set
 		 */
-		match = 0;
-		if(   !(de->flags[-sb.s_high_sierra] & 5)
-		   || sb.s_unhide == 'y' )
-		{
-		  match = iso_match(namelen, name, de->name, dlen);
+		if ((ent->flags & 5) && sb.s_unhide != 'y')
+			continue;
+
+		backlink = itp->inumber;
+		inode_number = ent->ino;
+		if (ent->kind == DE_DOT) {
+			/* "." matches "" as well */
+			if (namelen && !iso_match(namelen, name, ".", 1))
+				continue;
+			inode_number = itp->inumber;
+			backlink = 0;
+		} else if (ent->kind == DE_DOTDOT) {
+			if (!iso_match(namelen, name, "..", 2))
+				continue;
+			if ((int) sb.s_firstdatazone == itp->inumber)
+				inode_number = itp->inumber;
+			backlink = 0;
+		} else {
+			len = namelen;
+			if (ent->opt_dot && len == ent->name_len + 1
+			    && name[len - 1] == '.')
+				len--;
+			if (!iso_match(len, name, dc->names + ent->name,
+				       ent->name_len))
+				continue;
 		}
 
-		if (cpnt) cpnt = NULL;
+		*ino = inode_number;
+		*ino_back = backlink;
+		/* "." and ".." have no backlink to hand out on a hit */
+		if (iso_dcache_enter && backlink == (unsigned) itp->inumber)
+			iso_dcache_enter(itp->inumber, name, namelen,
+					 inode_number);
+#ifdef DEBUG_ISO
+		printf("iso_find_entry returning successfully (ino = %lu)\n",
+		       inode_number);
+#endif
+		return 0;
+	}
+#ifdef DEBUG_ISO
+	printf("iso_find_entry returning unsuccessfully\n");
+#endif
+	if (iso_dcache_enter)
+		iso_dcache_enter(itp->inumber, name, namelen, 0);
+	return -1;
+}
+
 
-		if (match) {
-		  if ((int) inode_number == -1) {
-		    /* Should never happen */
-		    printf("iso9660: error inode_number = -1\n");
-		    return -1;
-		  }
+/*
+ * Read the L path table described by PRI and index its records.
+ * Returns 0 on success, -1 (leaving no table) if it's unusable.
+ */
+static int
+iso_read_path_table (struct iso_primary_descriptor *pri)
+{
+	long size = (unsigned) isonum_733(pri->path_table_size);
+	long where = (unsigned) isonum_731(pri->type_l_path_table);
+	long rsize;
+	struct iso_path_table *pt;
+	char *table;
+	int off, n, pass;
+
+	path_table = NULL;
+	pt_count = 0;
+	if (size <= 0 || size > MAX_PATH_TABLE)
+		return -1;
+	/* in whole sectors, as the drive reads it anyway */
+	rsize = (size + ISOFS_BLOCK_SIZE - 1) & ~(ISOFS_BLOCK_SIZE - 1);
+	table = malloc(rsize);
+	if (!table)
+		return -1;
+	if (iso_dev_read(table, where << sb.s_log_zone_size, rsize) != rsize) {
+		free(table);
+		return -1;
+	}
 
-		  *ino = inode_number;
-		  *ino_back = backlink;
+	/* count the records, then note where each one starts */
+	for (pass = 0; pass < 2; pass++) {
+		n = 0;
+		for (off = 0; off + (int) sizeof(*pt) < size; ) {
+			pt = (struct iso_path_table *) (table + off);
+			if (pt->name_len[0] == 0
+			    || off + sizeof(*pt) + pt->name_len[0] > size)
+				break;
+			if (pass)
+				pt_offset[n] = off;
+			n++;
+			off += (sizeof(*pt) + pt->name_len[0] + 1) & ~1;
+		}
+		if (!pass) {
+			pt_offset = malloc(n * sizeof(int));
+			if (!n || !pt_offset) {
+				free(table);
+				return -1;
+			}
+		}
+	}
+	path_table = table;
+	pt_count = n;
 #ifdef DEBUG_ISO
-		  printf("iso_find_entry returning successfully (ino = %d)\n",
-			 inode_number);
+	printf("iso_read_path_table: %d directories\n", pt_count);
 #endif
-		  return 0;
+	return 0;
+}
+
+
+/*
+ * Does the disc carry Rock Ridge names?  SUSP puts an "SP" entry at
+ * the start of the system use area of the root's "." record.  If it
+ * can't be read, say yes: that only costs the path table.
+ */
+static int
+iso_has_rock (struct iso_directory_record *rootp)
+{
+	unsigned char rec[256];
+	struct iso_directory_record *de = (struct iso_directory_record *) rec;
+	long where = (unsigned) isonum_733(rootp->extent);
+	int off;
+
+	if (iso_dev_read(rec, where << sb.s_log_zone_size, sizeof(rec))
+	    != sizeof(rec))
+		return 1;
+	off = sizeof(*de) + isonum_711((char *) de->name_len);
+	if (off & 1) off++;
+	return off + 7 <= rec[0] && rec[off] == 'S' && rec[off + 1] == 'P'
+		&& rec[off + 4] == 0xbe && rec[off + 5] == 0xef;
+}
+
+
+/*
+ * Find the directory called NAME[0..LEN-1] in directory number DIR of
+ * the path table.  The table holds the plain ISO names, which are
+ * compared lower-cased, the way iso_find_entry() maps them; it is only
+ * read for discs without Rock Ridge, whose names could be anything.
+ * Returns its number, or 0 if there isn't exactly one such directory.
+ */
+static int
+iso_pt_find (int dir, const char *name, int len)
+{
+	struct iso_path_table *pt;
+	int i, j, found = 0;
+	char c;
+
+	for (i = 1; i < pt_count; i++) {
+		pt = (struct iso_path_table *) (path_table + pt_offset[i]);
+		if (isonum_721(pt->parent) != dir || pt->name_len[0] != len)
+			continue;
+		for (j = 0; j < len; j++) {
+			c = pt->name[j];
+			if (c >= 'A' && c <= 'Z') c |= 0x20;
+			if (c != name[j])
+				break;
 		}
+		if (j < len)
+			continue;
+		if (found)
+			return 0;	/* ambiguous, let the caller scan */
+		found = i + 1;
+	}
+	return found;
+}
+
+
+/*
+ * Resolve the leading directories of NAME, relative to the root,
+ * through the path table.  Sets *REST to the index in NAME where the
+ * components that are left start (at least the last one) and returns
+ * the inode number of the directory they are relative to: the "."
+ * record at the start of its extent.  Returns 0 if there's no path
+ * table.
+ */
+static unsigned long
+iso_pt_lookup (const char *name, int *rest)
+{
+	struct iso_path_table *pt;
+	const char *comp, *slash;
+	int dir = 1, next, len;
+
+	*rest = 0;
+	if (!path_table)
+		return 0;
+
+	for (comp = name; (slash = strchr(comp, '/')); comp = slash + 1) {
+		len = slash - comp;
+		if (len == 0 || (len == 1 && comp[0] == '.'))
+			next = dir;
+		else if (len == 2 && comp[0] == '.' && comp[1] == '.')
+			next = isonum_721(((struct iso_path_table *)
+					   (path_table + pt_offset[dir - 1]))
+					  ->parent);
+		else
+			next = iso_pt_find(dir, comp, len);
+		if (next < 1 || next > pt_count)
+			break;
+		dir = next;
+		*rest = slash + 1 - name;
 	}
+
+	pt = (struct iso_path_table *) (path_table + pt_offset[dir - 1]);
 #ifdef DEBUG_ISO
-		  printf("iso_find_entry returning unsuccessfully (ino = %d)\n",
-			 inode_number);
+	printf("iso_pt_lookup: %.*s is directory %d\n", *rest, name, dir);
 #endif
-	return -1;
+	return ((unsigned long) (unsigned) isonum_731(pt->extent)
+		+ pt->name_len[1]) << sb.s_log_zone_size;
 }
 
 
@@ -567,6 +1103,17 @@ iso_lookup(struct iso_inode *dir, const char *name)
 	/* work through the name finding each directory in turn */
 	ino = 0;
 	first = last = 0;
+
+	/* from the root, the path table gets us to the last directory */
+	if ((unsigned long) itp->inumber == root_inode
+	    && (ino = iso_pt_lookup(name, &first)) && first) {
+		if (ino != root_inode) {
+			iso_iput(dir);
+			if (!(dir = iso_iget(ino)))
+				return NULL;
+		}
+		last = first;
+	}
 	while (last < (int) strlen(name)) {
 		if (name[last] == '/') {
 			if (iso_find_entry(dir, &name[first], last - first,
@@ -615,7 +1162,9 @@ iso_follow_link(struct iso_inode *from, const char *basename)
 	struct iso_inode *root = iso_iget(root_inode);
 	/* HK: iso_iget expects an "int" but root_inode is "long" ?? */
 	struct iso_inode *result = NULL;
-	char *linkto;
+	struct iso_dir_entry *ent;
+	struct iso_dir_cache *dc;
+	char *linkto = NULL;
 
 #ifdef DEBUG_ISO
 	printf("iso_follow_link(%s): ",basename);
@@ -627,7 +1176,21 @@ iso_follow_link(struct iso_inode *from, const char *basename)
 	if (!itp->size)
 		return NULL;
 
-	if (!(linkto = get_rock_ridge_symlink(from)))
+	/*
+	 * Take a copy of the target parsed with the link's directory,
+	 * the lookup below may push that out of the cache.
+	 */
+	if (iso_dir_record(itp->inumber, &ent) && ent && ent->link >= 0
+	    && (linkto = malloc(ent->link_len + 1)))
+	{
+		for (dc = dir_cache; dc < dir_cache + DIR_CACHE_SLOTS; dc++) {
+			if (ent >= dc->ents && ent < dc->ents + dc->nents)
+				memcpy(linkto, dc->names + ent->link,
+				       ent->link_len + 1);
+		}
+		itp->size = ent->link_len;
+	}
+	if (!linkto && !(linkto = get_rock_ridge_symlink(from)))
 		return NULL;
 
 	linkto[itp->size]='\0';
@@ -695,6 +1258,15 @@ iso_read_super (void *data, int silent)
 		inode_table[i].free = 1;
 		inode_table[i].inumber = 0;
 	}
+	path_table = NULL;
+	pt_count = 0;
+	/* buffers of an earlier mount went with its arena */
+	memset(dir_cache, 0, sizeof(dir_cache));
+	dir_cache_next = 0;
+	/* isomarkboot never reads file data */
+	zf_in = iso_inflate ? malloc(ZF_IN_SIZE) : NULL;
+	memset(ce_extent, 0, sizeof(ce_extent));
+	ce_next = 0;
 
 #ifdef DEBUG_ISO
 	printf("iso_read_super() called\n");
@@ -713,8 +1285,8 @@ iso_read_super (void *data, int silent)
 #ifdef DEBUG_ISO
 		printf("iso_read_super: iso_blknum=%d\n", iso_blknum);
 #endif
-		if (iso_dev_read(data_block, iso_blknum * 2048,
-				 sb.s_blocksize) != sb.s_blocksize)
+		if (iso_dev_read(data_block, iso_blknum * ISOFS_BLOCK_SIZE,
+				 ISOFS_BLOCK_SIZE) != ISOFS_BLOCK_SIZE)
 		{
 			printf("iso_read_super: bread failed, dev "
 			       "iso_blknum %d\n", iso_blknum);
@@ -832,6 +1404,15 @@ iso_read_super (void *data, int silent)
 	 */
 	sb.s_mode = S_IRUGO & 0777;
 
+	/*
+	 * High Sierra path tables are laid out differently, and Rock
+	 * Ridge names needn't be the ISO names the table holds ("Boot"
+	 * and "boot" could be BOOT000 and BOOT); such discs just scan
+	 * directories.
+	 */
+	if (!high_sierra && !(sb.s_rock && iso_has_rock(rootp)))
+		iso_read_path_table(pri);
+
 	/* return successfully */
 	root_inode = isonum_733 (rootp->extent) << sb.s_log_zone_size;
 	/* HK: isonum_733 returns an "int" but root_inode is a long ? */
@@ -901,6 +1482,9 @@ iso_close (int fd)
 long
 iso_map (int fd, long block)
 {
+	/* a compressed file has no data on disc to point at */
+	if (inode_table[fd].zf_shift)
+		return -1;
 	return iso_bmap(&inode_table[fd].inode, block) * sb.s_blocksize;
 }
 
@@ -923,200 +1507,40 @@ iso_fstat (int fd, struct stat * buf)
 }
 
 /*
- * NOTE: mixing calls to this and calls to any other function that reads from
- * the filesystem will clobber the buffers and cause much wailing and gnashing
- * of teeth.
- *
- * Sorry this function is so ugly. It was written as a way for me to
- * learn how the ISO filesystem stuff works.
- *
- * Will Woods, 2/2001
- *
- * Uses data_block
+ * Return the next name in directory FD, or NULL at its end.  The
+ * names come parsed from the directory cache; a lookup in between
+ * only costs a re-read if it pushed the directory out of the cache.
  */
 char *iso_readdir_i(int fd, int rewind) {
     struct inode_table_entry *itp = &(inode_table[fd]);
-    struct iso_directory_record *dirent = 0;
-    unsigned int fraglen = 0, block, dirent_len, name_len = 0, oldoffset;
-    static unsigned int blockoffset = 0, diroffset = 0;
+    struct iso_dir_cache *dc;
+    struct iso_dir_entry *ent;
+    static int dirpos = 0;
 
     if (!S_ISDIR(itp->mode)) {
 	printf("Not a directory\n");
 	return NULL;
     }
 
-    /* Initial read to this directory, get the first block */
-    if (rewind) {
-	blockoffset = diroffset = 0;
-	block = iso_bmap(&itp->inode,0);
-#ifdef DEBUG_ISO
-	printf("fd #%d, inode %d, first_extent %d, block %u\n",
-	       fd,itp->inumber,itp->inode.i_first_extent,block);
-#endif
-	if (!block) return NULL;
-
-	if (iso_dev_read(data_block, block * sb.s_blocksize, sb.s_blocksize)
-	    != sb.s_blocksize) return NULL;
-    }
-
-    /* keep doing this until we get a filename or we fail */
-    while (!name_len) {
-	/* set up our dirent pointer into the block of data we've read */
-	dirent = (struct iso_directory_record *) (data_block + blockoffset);
-	dirent_len = isonum_711(dirent->length);
-#ifdef DEBUG_ISO
-	printf("diroffset=%u, blockoffset=%u, length=%u\n",
-	       diroffset,blockoffset,dirent_len);
-#endif
-
-	/* End of directory listing or end of sector */
-	if (dirent_len == 0) {
-	    /* round diroffset up to the nearest blocksize */
-	    diroffset = ((diroffset & ~(ISOFS_BLOCK_SIZE - 1))
-			 + ISOFS_BLOCK_SIZE);
-#ifdef DEBUG_ISO
-	    printf("dirent_len == 0. diroffset=%u, itp->size=%u. ",
-		   diroffset,itp->size);
-#endif
-	    if (diroffset >= itp->size) {
-#ifdef DEBUG_ISO
-		printf("End of directory.\n");
-#endif
-		return NULL;
-	    } else {
-#ifdef DEBUG_ISO
-		printf("End of sector. Need next block.\n");
-#endif
-		/* Get the next block. */
-		block = iso_bmap(&itp->inode, diroffset>>sb.s_blocksize_bits);
-		if (!block) return NULL;
-		if (iso_dev_read(data_block, block * sb.s_blocksize, sb.s_blocksize)
-		    != sb.s_blocksize) return NULL;
-
-		/* set the offsets and the pointers properly */
-		blockoffset = 0;
-		dirent = (struct iso_directory_record *) data_block;
-		dirent_len = isonum_711(dirent->length);
-#ifdef DEBUG_ISO
-		printf("diroffset=%u, blockoffset=%u, length=%u\n",
-		       diroffset,blockoffset,dirent_len);
-#endif
-	    }
-	}
-
-	/* update the offsets for the next read */
-	oldoffset = blockoffset;
-	blockoffset += dirent_len;
-	diroffset += dirent_len;
-
-	/*
-	 * directory entry spans two blocks -
-	 * get next block and glue the two halves together
-	 */
-	if (blockoffset >= sb.s_blocksize) {
-	    fraglen = sb.s_blocksize - oldoffset;
-#ifdef DEBUG_ISO
-	    printf("fragmented block: blockoffset = %u, fraglen = %u\n",
-		   blockoffset, fraglen);
-#endif
-	    /* copy the fragment at end of old block to front of new buffer */
-	    memcpy(big_data_block, data_block + oldoffset, fraglen);
-
-	    /* read the next block into the buffer after the old fragment */
-	    block = iso_bmap(&itp->inode, diroffset >> sb.s_blocksize_bits);
-	    if (!block) return NULL;
-	    if (iso_dev_read(big_data_block + fraglen, block * sb.s_blocksize, sb.s_blocksize)
-		!= sb.s_blocksize) return NULL;
-#ifdef DEBUG_ISO
-	    printf("read %u bytes from offset %u\n",
-		   sb.s_blocksize, block * sb.s_blocksize);
-#endif
-
-	    blockoffset = 0;
-	    dirent = (struct iso_directory_record *) big_data_block;
-	}
+    if (rewind)
+	dirpos = 0;
+    if (!(dc = iso_dir_load(&itp->inode)))
+	return NULL;
 
+    while (dirpos < dc->nents) {
+	ent = &dc->ents[dirpos++];
+	/* skip '.' and '..' */
+	if (ent->kind != DE_FILE)
+	    continue;
 	/*
-	 * Everything's cool, let's get the filename.
-	 * First we need to figure out the length.
+	 * if bit 0 (exists) or bit 2 (associated) are set, we ignore
+	 * this record.
 	 */
-	name_len = isonum_711((char *) dirent->name_len);
-#ifdef DEBUG_ISO
-	if (name_len==0) printf("dirent->name_len = 0, skipping.\n");
-#endif
-
-	/* skip '.' and '..' */
-	if (name_len == 1) {
-	    if (dirent->name[0] == (char)0) name_len = 0;
-	    if (dirent->name[0] == (char)1) name_len = 0;
-	}
-
-
-	if (sb.s_unhide == 'n') {
-	    /* sb.s_high_sierra is the offset for the position of the flags.
-	       this adjusts for differences between iso9660 and high sierra.
-
-	       if bit 0 (exists) or bit 2 (associated) are set, we ignore
-	       this record. */
-	    if (dirent->flags[-sb.s_high_sierra] & 5) name_len = 0;
-	}
-
-	/* if we have a real filename here.. */
-	if (name_len) {
-	    /* should be sufficient, since get_rock_ridge_filename truncates
-	       at 254 characters */
-	    char rrname[256];
-	    if ((name_len = get_rock_ridge_filename(dirent, rrname, &itp->inode))) {
-		rrname[name_len] = '\0';
-		/* it's okay if rrname is longer than dirent->name, because
-		   we're just overwriting parts of the now-useless dirent */
-		strcpy(dirent->name, rrname);
-	    } else {
-	        int i;
-	        char c;
-		if (sb.s_mapping == 'n') { /* downcase the name */
-		    for (i = 0; i < name_len; i++) {
-			c = dirent->name[i];
-
-                        /* lower case */
-			if ((c >= 'A') && (c <= 'Z')) c |= 0x20;
-
-			/* Drop trailing '.;1' */
-			if ((c == '.') && (i == name_len-3) &&
-			    (dirent->name[i+1] == ';') &&
-                            (dirent->name[i+2] == '1')) {
-			    name_len -= 3 ; break;
-			}
-
-			/* Drop trailing ';1' */
-			if ((c == ';') && (i == name_len-2) &&
-                            (dirent->name[i+1] == '1')) {
-			    name_len -= 2; break;
-			}
-
-			/* convert ';' to '.' */
-			if (c == ';')
-			    c = '.';
-
-			dirent->name[i] = c;
-		    }
-		    dirent->name[name_len] = '\0';
-		}
-	    }
-	}
-	/* now that we're done using it, and it's smaller than a full block,
-	 * copy big_data_block back into data_block */
-	if (fraglen) {
-            int len = sb.s_blocksize - dirent_len;
-	    memcpy(data_block, big_data_block + dirent_len, len);
-#ifdef DEBUG_ISO
-	    printf("copied %u bytes of data back to data_block\n", len);
-#endif
-	    blockoffset = 0;
-	    fraglen = 0;
-	}
+	if (sb.s_unhide == 'n' && (ent->flags & 5))
+	    continue;
+	return dc->names + ent->name;
     }
-    return dirent->name;
+    return NULL;
 }
 
 /**********************************************************************
@@ -1140,7 +1564,7 @@ char *iso_readdir_i(int fd, int rewind) {
 
 #define CONTINUE_DECLS \
   int cont_extent = 0, cont_offset = 0, cont_size = 0;   \
-  void * buffer = 0
+  unsigned char * buffer = 0
 
 #define CHECK_CE	       			\
       {cont_extent = isonum_733(rr->u.CE.extent); \
@@ -1154,13 +1578,10 @@ char *iso_readdir_i(int fd, int rewind) {
   LEN = *((unsigned char *) DE) - LEN;}
 
 #define MAYBE_CONTINUE(LABEL) \
-  {if (buffer) free(buffer); \
-  if (cont_extent){ \
-    buffer = malloc(cont_size); \
-    if (!buffer) goto out; \
-    if (iso_dev_read(buffer, cont_extent * ISOFS_BLOCK_SIZE + cont_offset, cont_size) \
-	  == cont_size) { \
-        chr = (unsigned char *) buffer; \
+  {if (cont_extent){ \
+    buffer = iso_read_ce(cont_extent, cont_offset, cont_size); \
+    if (buffer) { \
+        chr = buffer; \
         len = cont_size; \
         cont_extent = cont_size = cont_offset = 0; \
         goto LABEL; \
@@ -1168,6 +1589,32 @@ char *iso_readdir_i(int fd, int rewind) {
     printf("Unable to read rock-ridge attributes\n");    \
   }}
 
+/*
+ * Return the SIZE bytes of continuation area at OFFSET in sector
+ * EXTENT, or NULL.  The sector is read once and kept in ce_cache.
+ */
+static unsigned char *
+iso_read_ce (int extent, int offset, int size)
+{
+  int i;
+
+  if (extent <= 0 || offset < 0 || size <= 0
+      || offset + size > ISOFS_BLOCK_SIZE)
+    return NULL;
+  for (i = 0; i < CE_CACHE_SLOTS; i++)
+    if (ce_extent[i] == extent)
+      return (unsigned char *) ce_cache[i] + offset;
+
+  i = ce_next;
+  ce_next = (ce_next + 1) % CE_CACHE_SLOTS;
+  ce_extent[i] = 0;
+  if (iso_dev_read(ce_cache[i], (long) extent * ISOFS_BLOCK_SIZE,
+		   ISOFS_BLOCK_SIZE) != ISOFS_BLOCK_SIZE)
+    return NULL;
+  ce_extent[i] = extent;
+  return (unsigned char *) ce_cache[i] + offset;
+}
+
 int get_rock_ridge_filename(struct iso_directory_record * de,
 			    char * retname,
 			    struct iso_inode * inode)
@@ -1176,7 +1623,6 @@ int get_rock_ridge_filename(struct iso_directory_record * de,
   unsigned char * chr;
   int retnamlen = 0, truncate=0;
   int cont_extent = 0, cont_offset = 0, cont_size = 0;
-  void *buffer = 0;
 
   /* No rock ridge? well then... */
   if (!sb.s_rock) return 0;
@@ -1247,20 +1693,15 @@ int get_rock_ridge_filename(struct iso_directory_record * de,
       }
     };
   }
-  if (buffer) free(buffer);
   if (cont_extent) { /* we had a continued record */
-      buffer = malloc(cont_size);
-      if (!buffer) goto out;
-      if (iso_dev_read(buffer, cont_extent * ISOFS_BLOCK_SIZE + cont_offset, cont_size)
-	  != cont_size) goto out;
-      chr = buffer + cont_offset;
+      chr = iso_read_ce(cont_extent, cont_offset, cont_size);
+      if (!chr) goto out;
       len = cont_size;
       cont_extent = cont_size = cont_offset = 0;
       goto repeat;
   }
   return retnamlen; /* If 0, this file did not have a NM field */
  out:
-  if (buffer) free(buffer);
   return 0;
 }
 
@@ -1336,6 +1777,19 @@ static int parse_rock_ridge_inode(struct iso_directory_record * de,
       case SIG('T','F'):
         /* create/modify/access times are uninteresting to us. */
 	break;
+      case SIG('Z','F'):
+#ifdef DEBUG_ROCK
+  printf("ZF ");
+#endif
+	if (rr->u.ZF.algorithm[0] != 'p' || rr->u.ZF.algorithm[1] != 'z') {
+	  printf("Unknown zisofs algorithm %c%c\n",
+		 rr->u.ZF.algorithm[0], rr->u.ZF.algorithm[1]);
+	  break;
+	}
+	itp->zf_header = rr->u.ZF.parms[0];
+	itp->zf_shift  = rr->u.ZF.parms[1];
+	itp->zf_size   = isonum_733(rr->u.ZF.real_size);
+	break;
       case SIG('S','L'):
 #ifdef DEBUG_ROCK
   printf("SL ");
@@ -1421,7 +1875,6 @@ static int parse_rock_ridge_inode(struct iso_directory_record * de,
 #endif
   return 1;
  out:
-  if(buffer) free(buffer);
 #ifdef DEBUG_ROCK
   printf("\nparse_rock_ridge_inode(): failed\n");
 #endif
@@ -1437,21 +1890,20 @@ static char * get_rock_ridge_symlink(struct iso_inode *inode)
   int blockbits = ISOFS_BLOCK_BITS;
   char * rpnt = NULL;
   unsigned char * pnt;
-  struct iso_directory_record * raw_inode;
   struct inode_table_entry *itp = (struct inode_table_entry *)inode;
-  CONTINUE_DECLS;
   int block, blockoffset;
-  int sig;
-  int rootflag;
-  int len;
-  unsigned char * chr, * buf = NULL;
-  struct rock_ridge * rr;
+  unsigned char * buf = NULL;
 
 #ifdef DEBUG_ROCK
   printf("get_rock_ridge_symlink(%u): link is %u bytes long\n",itp->inumber, itp->size);
 #endif
 
-  if (!sb.s_rock) goto out;
+  if (!sb.s_rock) goto out_freebh;
+
+  /* the record is usually still in the directory cache */
+  if ((pnt = iso_dir_record(itp->inumber, NULL)))
+    return parse_rock_ridge_symlink((struct iso_directory_record *) pnt,
+				    itp->size);
 
   block = itp->inumber >> blockbits;
   blockoffset = itp->inumber & (blocksize - 1);
@@ -1463,14 +1915,45 @@ static char * get_rock_ridge_symlink(struct iso_inode *inode)
 
   pnt = ((unsigned char *) buf) + blockoffset;
 
-  raw_inode = ((struct iso_directory_record *) pnt);
-
   /*
    * If we go past the end of the buffer, there is some sort of error.
    */
   if (blockoffset + *pnt > blocksize)
 	goto out_bad_span;
 
+  rpnt = parse_rock_ridge_symlink((struct iso_directory_record *) pnt,
+				  itp->size);
+
+ out_freebh:
+#ifdef DEBUG_ROCK
+  printf("\nget_rock_ridge_symlink() exiting\n");
+#endif
+        if (buf)
+		free(buf);
+	return rpnt;
+
+out_noread:
+	printf("unable to read block");
+	goto out_freebh;
+out_bad_span:
+	printf("symlink spans iso9660 blocks\n");
+	goto out_freebh;
+}
+
+/* Returns the SIZE byte target of the symlink whose directory record is
+   RAW_INODE, in malloc memory, or NULL */
+
+static char * parse_rock_ridge_symlink(struct iso_directory_record *raw_inode,
+				       int size)
+{
+  char * rpnt = NULL;
+  CONTINUE_DECLS;
+  int sig;
+  int rootflag;
+  int len;
+  unsigned char * chr;
+  struct rock_ridge * rr;
+
   /* Now test for possible Rock Ridge extensions which will override some of
      these numbers in the inode structure. */
 
@@ -1502,7 +1985,7 @@ static char * get_rock_ridge_symlink(struct iso_inode *inode)
        slp = &rr->u.SL.link;
        while (slen > 1){
 	 if (!rpnt){
-	   rpnt = malloc (itp->size +1);
+	   rpnt = malloc (size +1);
 	   if (!rpnt) goto out;
 	   *rpnt = 0;
 	 };
@@ -1558,33 +2041,14 @@ static char * get_rock_ridge_symlink(struct iso_inode *inode)
     };
   };
   MAYBE_CONTINUE(repeat);
-
- out_freebh:
-#ifdef DEBUG_ROCK
-  printf("\nget_rock_ridge_symlink() exiting\n");
-#endif
-        if (buf)
-		free(buf);
-	return rpnt;
+  return rpnt;
 
 	/* error exit from macro */
 out:
 #ifdef DEBUG_ROCK
 	printf("abort");
 #endif
-	if(buffer)
-		free(buffer);
 	if(rpnt)
 		free(rpnt);
-	rpnt = NULL;
-	goto out_freebh;
-out_noread:
-	printf("unable to read block");
-	goto out_freebh;
-out_bad_span:
-	printf("symlink spans iso9660 blocks\n");
-	goto out_freebh;
+	return NULL;
 }
-
-
-
@@ -0,0 +1,118 @@
+/*
+ *  aboot/lib/membench.c
+ *
+ * Host microbenchmark for memcpy.c and memset.c: times the word at a
+ * time routines against the MEM_SMALL byte loops and checks that both
+ * produce the same bytes.  Built with "make TESTING=yes lib/membench";
+ * the MEM_SMALL objects are compiled with their symbols renamed to
+ * small_*.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void *__memcpy(void *dest, const void *source, size_t n);
+void *__memmove(void *dest, const void *source, size_t n);
+void *__memset(void *s, char c, size_t n);
+void *small_memcpy(void *dest, const void *source, size_t n);
+void *small_memmove(void *dest, const void *source, size_t n);
+void *small_memset(void *s, char c, size_t n);
+
+#define BIG	(16 << 20)	/* about the size of a kernel */
+#define SMALL	64		/* a directory entry or so */
+
+static unsigned char *src, *dst, *ref;
+
+enum op { COPY, MOVE, SET };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+/*
+ * Run OP with the fast or the small routines REPS times on N bytes,
+ * the destination at DST + DOFF and the source at SRC + SOFF (or,
+ * for MOVE, within the destination buffer).  Returns milliseconds.
+ */
+static double
+run(enum op op, int small, unsigned char *to, size_t soff, size_t doff,
+    size_t n, long reps)
+{
+	double start = now();
+	long i;
+
+	for (i = 0; i < reps; i++) {
+		switch (op) {
+		case COPY:
+			if (small)
+				small_memcpy(to + doff, src + soff, n);
+			else
+				__memcpy(to + doff, src + soff, n);
+			break;
+		case MOVE:
+			if (small)
+				small_memmove(to + doff, to + soff, n);
+			else
+				__memmove(to + doff, to + soff, n);
+			break;
+		case SET:
+			if (small)
+				small_memset(to + doff, (char) i, n);
+			else
+				__memset(to + doff, (char) i, n);
+			break;
+		}
+	}
+	return now() - start;
+}
+
+
+static void
+bench(const char *name, enum op op, size_t soff, size_t doff, size_t n,
+      long reps)
+{
+	double fast, small;
+	size_t len = n + 64;
+
+	memcpy(dst, src, len);
+	memcpy(ref, src, len);
+	fast = run(op, 0, dst, soff, doff, n, reps);
+	small = run(op, 1, ref, soff, doff, n, reps);
+
+	printf("%-28s %9.2f ms %9.2f ms %6.2fx%s\n", name, fast, small,
+	       small / fast, memcmp(dst, ref, len) ? "  MISMATCH" : "");
+}
+
+
+int
+main(void)
+{
+	long i;
+
+	src = malloc(BIG + 64);
+	dst = malloc(BIG + 64);
+	ref = malloc(BIG + 64);
+	if (!src || !dst || !ref) {
+		fprintf(stderr, "membench: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < BIG + 64; i++)
+		src[i] = rand();
+
+	printf("%-28s %12s %12s %7s\n", "", "word", "MEM_SMALL", "gain");
+	bench("memcpy 16MB aligned",	COPY, 0, 0, BIG, 4);
+	bench("memcpy 16MB misaligned",	COPY, 3, 0, BIG, 4);
+	bench("memcpy 64B x 1M",	COPY, 0, 0, SMALL, 1 << 20);
+	bench("memmove 16MB up by 5",	MOVE, 0, 5, BIG - 8, 4);
+	bench("memmove 16MB down by 5",	MOVE, 5, 0, BIG - 8, 4);
+	bench("memset 16MB",		SET, 0, 0, BIG, 4);
+	bench("memset 64B x 1M",	SET, 0, 1, SMALL, 1 << 20);
+	return 0;
+}
@@ -5,10 +5,10 @@
  */
 #include <sys/types.h>
 
+#ifdef MEM_SMALL
+
 /*
- * Booting is I/O bound so rather than a time-optimized, we want
- * a space-optimized memcpy.  Not that the rest of the loader
- * were particularly small, though...
+ * Space-optimized versions, selected with MEMOPT=size.
  */
 void *__memcpy(void *dest, const void *source, size_t n)
 {
@@ -20,3 +20,178 @@ void *__memcpy(void *dest, const void *source, size_t n)
 	}
 	return dest;
 }
+
+
+void *__memmove(void *dest, const void *source, size_t n)
+{
+	char *dst = dest;
+	const char *src = source;
+
+	if (dst <= src)
+		return __memcpy(dest, source, n);
+
+	dst += n;
+	src += n;
+	while (n--) {
+		*--dst = *--src;
+	}
+	return dest;
+}
+
+#else /* !MEM_SMALL */
+
+/*
+ * Booting used to be I/O bound, but with the sector cache and
+ * read-ahead in place clearing bss and moving the kernel around
+ * show up, so copy a quadword at a time.  All stores are aligned;
+ * a misaligned source is handled by merging neighbouring aligned
+ * loads on Alpha and by unaligned loads elsewhere.
+ */
+typedef unsigned long word_t __attribute__((__may_alias__));
+
+#define WORD	sizeof(word_t)
+#define WMASK	(WORD - 1)
+
+static inline unsigned long
+load_word(const unsigned char *p)
+{
+	unsigned long w;
+
+	__builtin_memcpy(&w, p, WORD);
+	return w;
+}
+
+
+/*
+ * Copy from low to high addresses.  Each word is loaded before the
+ * store that could overlap it, so this is also safe for memmove()
+ * when dst <= src.
+ */
+static void
+copy_fwd(unsigned char *dst, const unsigned char *src, size_t n)
+{
+	if (n >= 2 * WORD) {
+		/* align the destination */
+		while ((unsigned long) dst & WMASK) {
+			*dst++ = *src++;
+			n--;
+		}
+
+		if (((unsigned long) src & WMASK) == 0) {
+			while (n >= 4 * WORD) {
+				word_t a = ((const word_t *) src)[0];
+				word_t b = ((const word_t *) src)[1];
+				word_t c = ((const word_t *) src)[2];
+				word_t d = ((const word_t *) src)[3];
+
+				((word_t *) dst)[0] = a;
+				((word_t *) dst)[1] = b;
+				((word_t *) dst)[2] = c;
+				((word_t *) dst)[3] = d;
+				src += 4 * WORD;
+				dst += 4 * WORD;
+				n -= 4 * WORD;
+			}
+			while (n >= WORD) {
+				*(word_t *) dst = *(const word_t *) src;
+				src += WORD;
+				dst += WORD;
+				n -= WORD;
+			}
+		} else {
+#ifdef __alpha__
+			/* one aligned load per word, like ldq_u/extql/extqh */
+			unsigned long sh = ((unsigned long) src & WMASK) * 8;
+			const word_t *ws = (const word_t *)
+				((unsigned long) src & ~WMASK);
+			unsigned long lo = *ws++, hi;
+
+			while (n >= WORD) {
+				hi = *ws++;
+				*(word_t *) dst = (lo >> sh) | (hi << (8 * WORD - sh));
+				lo = hi;
+				src += WORD;
+				dst += WORD;
+				n -= WORD;
+			}
+#else
+			while (n >= WORD) {
+				*(word_t *) dst = load_word(src);
+				src += WORD;
+				dst += WORD;
+				n -= WORD;
+			}
+#endif
+		}
+	}
+	while (n--) {
+		*dst++ = *src++;
+	}
+}
+
+
+/*
+ * Copy from high to low addresses, for overlapping memmove() with
+ * dst > src.
+ */
+static void
+copy_bwd(unsigned char *dst, const unsigned char *src, size_t n)
+{
+	dst += n;
+	src += n;
+	if (n >= 2 * WORD) {
+		/* align the end of the destination */
+		while ((unsigned long) dst & WMASK) {
+			*--dst = *--src;
+			n--;
+		}
+
+		if (((unsigned long) src & WMASK) == 0) {
+			while (n >= 4 * WORD) {
+				word_t a = ((const word_t *) src)[-1];
+				word_t b = ((const word_t *) src)[-2];
+				word_t c = ((const word_t *) src)[-3];
+				word_t d = ((const word_t *) src)[-4];
+
+				((word_t *) dst)[-1] = a;
+				((word_t *) dst)[-2] = b;
+				((word_t *) dst)[-3] = c;
+				((word_t *) dst)[-4] = d;
+				src -= 4 * WORD;
+				dst -= 4 * WORD;
+				n -= 4 * WORD;
+			}
+		}
+		while (n >= WORD) {
+			src -= WORD;
+			dst -= WORD;
+			*(word_t *) dst = load_word(src);
+			n -= WORD;
+		}
+	}
+	while (n--) {
+		*--dst = *--src;
+	}
+}
+
+
+void *__memcpy(void *dest, const void *source, size_t n)
+{
+	copy_fwd(dest, source, n);
+	return dest;
+}
+
+
+void *__memmove(void *dest, const void *source, size_t n)
+{
+	unsigned char *dst = dest;
+	const unsigned char *src = source;
+
+	if (dst <= src || dst >= src + n)
+		copy_fwd(dst, src, n);
+	else
+		copy_bwd(dst, src, n);
+	return dest;
+}
+
+#endif /* !MEM_SMALL */
@@ -5,10 +5,10 @@
  */
 #include <sys/types.h>
 
+#ifdef MEM_SMALL
+
 /*
- * Booting is I/O bound so rather than a time-optimized, we want
- * a space-optimized memcpy.  Not that the rest of the loader
- * were particularly small, though...
+ * Space-optimized version, selected with MEMOPT=size.
  */
 void *__memset(void *s, char c, size_t n)
 {
@@ -20,6 +20,51 @@ void *__memset(void *s, char c, size_t n)
 	return s;
 }
 
+#else /* !MEM_SMALL */
+
+/*
+ * Clearing a multi-megabyte bss is the main user, so store a
+ * quadword at a time once the destination is aligned.
+ */
+typedef unsigned long word_t __attribute__((__may_alias__));
+
+#define WORD	sizeof(word_t)
+#define WMASK	(WORD - 1)
+
+void *__memset(void *s, char c, size_t n)
+{
+	unsigned char *dst = s;
+
+	if (n >= 2 * WORD) {
+		/* c replicated into every byte of a word */
+		word_t w = ~0UL / 0xff * (unsigned char) c;
+
+		while ((unsigned long) dst & WMASK) {
+			*dst++ = c;
+			n--;
+		}
+		while (n >= 4 * WORD) {
+			((word_t *) dst)[0] = w;
+			((word_t *) dst)[1] = w;
+			((word_t *) dst)[2] = w;
+			((word_t *) dst)[3] = w;
+			dst += 4 * WORD;
+			n -= 4 * WORD;
+		}
+		while (n >= WORD) {
+			*(word_t *) dst = w;
+			dst += WORD;
+			n -= WORD;
+		}
+	}
+	while (n--) {
+		*dst++ = c;
+	}
+	return s;
+}
+
+#endif /* !MEM_SMALL */
+
 
 void *__constant_c_memset(void *dest, char c, size_t n)
 {
@@ -14,6 +14,10 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+void *__memset(void *s, char c, size_t n);
+void *__memcpy(void *dest, const void *source, size_t n);
+void *__memmove(void *dest, const void *source, size_t n);
+
 char * ___strtok = NULL;
 
 char * strcpy(char * dest,const char *src)
@@ -174,44 +178,20 @@ char * strtok(char * s,const char * ct)
 	return (sbegin);
 }
 
+/* the real work is done in memcpy.c and memset.c */
 void * memset(void * s, int c, size_t count)
 {
-	char *xs = (char *) s;
-
-	while (count--)
-		*xs++ = c;
-
-	return s;
+	return __memset(s, c, count);
 }
 
 void * memcpy(void * dest,const void *src,size_t count)
 {
-	char *tmp = (char *) dest, *s = (char *) src;
-
-	while (count--)
-		*tmp++ = *s++;
-
-	return dest;
+	return __memcpy(dest, src, count);
 }
 
 void * memmove(void * dest,const void *src,size_t count)
 {
-	char *tmp, *s;
-
-	if (dest <= src) {
-		tmp = (char *) dest;
-		s = (char *) src;
-		while (count--)
-			*tmp++ = *s++;
-		}
-	else {
-		tmp = (char *) dest + count;
-		s = (char *) src + count;
-		while (count--)
-			*--tmp = *--s;
-		}
-
-	return dest;
+	return __memmove(dest, src, count);
 }
 
 int memcmp(const void * cs,const void * ct,size_t count)
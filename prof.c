@@ -0,0 +1,200 @@
+/*
+ * aboot/prof.c
+ *
+ * This file is part of aboot, the SRM bootloader for Linux/Alpha
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Boot phase profiler.
+ *
+ * Times are taken from the RPCC cycle counter.  Only its low 32 bits
+ * count, so they wrap every few seconds; the counter is sampled on
+ * every phase change and every cons_read() and the differences are
+ * accumulated in 64 bits.  A single console call that takes more than
+ * 2^32 cycles is undercounted.  TESTING builds use clock_gettime()
+ * and count nanoseconds instead.
+ */
+#ifdef TESTING
+#  include <stdio.h>
+#  include <time.h>
+#endif
+
+#include "hwrpb.h"
+#include "prof.h"
+#include "utils.h"
+#ifndef TESTING
+#  include "cons.h"
+#endif
+
+#define PROF_DEPTH	8		/* deepest phase nesting */
+
+static const char *prof_name[PROF_NPHASES] = {
+	"cons_init", "disklabel", "mount", "namei", "kernel read",
+	"decompress", "crc/copy", "bss clear", "initrd"
+};
+
+static unsigned long prof_cycles[PROF_NPHASES];
+static unsigned long prof_bytes[PROF_NPHASES];
+
+static int		prof_stack[PROF_DEPTH];
+static int		prof_sp;
+static int		prof_running;
+static unsigned long	prof_last;	/* last raw counter value */
+static unsigned long	prof_clock;	/* cycles since the first phase */
+static unsigned long	prof_mark;	/* prof_clock at the last charge */
+
+static unsigned long	prof_reads;	/* cons_read() calls */
+static unsigned long	prof_read_bytes; /* bytes asked of cons_read() */
+
+
+#ifdef TESTING
+
+#define PROF_MASK	(~0UL)
+
+static unsigned long
+read_counter(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned long
+counter_freq(void)
+{
+	return 1000000000UL;
+}
+
+#else
+
+#define PROF_MASK	0xffffffffUL
+
+static unsigned long
+read_counter(void)
+{
+	unsigned long cc;
+
+	__asm__ __volatile__("rpcc %0" : "=r"(cc));
+	return cc;
+}
+
+static unsigned long
+counter_freq(void)
+{
+	return INIT_HWRPB->cycle_freq;
+}
+
+#endif /* TESTING */
+
+
+/*
+ * Charge the cycles since the last call to the innermost running
+ * phase.
+ */
+static void
+prof_charge(void)
+{
+	unsigned long raw = read_counter();
+
+	if (!prof_running) {
+		prof_running = 1;
+		prof_last = raw;
+	}
+	prof_clock += (raw - prof_last) & PROF_MASK;
+	prof_last = raw;
+
+	if (prof_sp)
+		prof_cycles[prof_stack[prof_sp - 1]] += prof_clock - prof_mark;
+	prof_mark = prof_clock;
+}
+
+
+void
+prof_start(int phase)
+{
+	prof_charge();
+	if (prof_sp < PROF_DEPTH)
+		prof_stack[prof_sp++] = phase;
+}
+
+
+/*
+ * End PHASE, along with any phase nested in it that was left open by
+ * a longjmp().
+ */
+void
+prof_stop(int phase)
+{
+	int i;
+
+	prof_charge();
+	for (i = prof_sp - 1; i >= 0; --i) {
+		if (prof_stack[i] == phase) {
+			prof_sp = i;
+			break;
+		}
+	}
+}
+
+
+/* account a cons_read() of NBYTES to the running phase */
+void
+prof_io(long nbytes)
+{
+	prof_charge();
+	prof_reads++;
+	prof_read_bytes += nbytes;
+	if (prof_sp)
+		prof_bytes[prof_stack[prof_sp - 1]] += nbytes;
+}
+
+
+void
+prof_report(void)
+{
+	unsigned long freq = counter_freq();
+	unsigned long per_ms, rate;
+	int i;
+
+	prof_charge();
+	if (freq < 1000)
+		return;
+	per_ms = freq / 1000;
+
+	printf("aboot: boot profile (%lu MHz counter):\n", freq / 1000000);
+	printf("  phase              ms        bytes      MB/s\n");
+	for (i = 0; i < PROF_NPHASES; ++i) {
+		if (!prof_cycles[i] && !prof_bytes[i])
+			continue;
+		printf("  %-12s %8lu %12lu", prof_name[i],
+		       prof_cycles[i] / per_ms, prof_bytes[i]);
+		if (prof_bytes[i] && prof_cycles[i]) {
+			/* tenths of MB/s */
+			rate = prof_bytes[i] / 1024 * 10 * freq
+				/ prof_cycles[i] / 1024;
+			printf(" %7lu.%lu", rate / 10, rate % 10);
+		}
+		printf("\n");
+	}
+	printf("  total %lu ms, %lu cons_read calls for %lu bytes\n",
+	       prof_clock / per_ms, prof_reads, prof_read_bytes);
+#ifndef TESTING
+	printf("  sector cache: %ld hits, %ld misses, %ld bounced sectors\n",
+	       cons_cache_hits, cons_cache_misses, cons_bounce_reads);
+#endif
+}
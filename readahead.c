@@ -0,0 +1,195 @@
+/*
+ * aboot/readahead.c
+ *
+ * This file is part of aboot, the SRM bootloader for Linux/Alpha
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Sequential read-ahead for the bootfs bread hook.
+ *
+ * The gzip input path asks for one INBUFSIZ chunk at a time, which
+ * turns a kernel load into hundreds of mid-sized device reads.  This
+ * layer sits between the loader and the filesystem driver: when it
+ * sees a file being read sequentially it fetches an ever growing
+ * window (up to READAHEAD_MAX bytes) in a single bread and serves the
+ * following requests from memory.  Random access and requests at
+ * least as large as the window go straight to the driver.
+ */
+#ifdef TESTING
+#  include <stdlib.h>
+#  include <stdio.h>
+#endif
+
+#include "config.h"
+#include "bootfs.h"
+#include "utils.h"
+#include <string.h>
+
+#define RA_MAX_FD	8		/* fds tracked for sequential access */
+
+static const struct bootfs *lower;	/* the filesystem we wrap */
+static struct bootfs ra_fs;
+
+static struct ra_state {
+	long	next_blkno;		/* where a sequential read continues */
+	long	window;			/* current read-ahead size, in blocks */
+} ra_state[RA_MAX_FD];
+
+static char *	ra_buf;			/* READAHEAD_MAX bytes */
+static int	ra_fd = -1;		/* owner of the data in ra_buf */
+static long	ra_blkno;		/* first block held in ra_buf */
+static long	ra_len;			/* valid bytes in ra_buf */
+
+
+static void
+ra_forget(int fd)
+{
+	if (fd >= 0 && fd < RA_MAX_FD) {
+		ra_state[fd].next_blkno = -1;
+		ra_state[fd].window = 0;
+	}
+	if (fd == ra_fd)
+		ra_fd = -1;
+}
+
+
+/*
+ * Copy as much of [blkno, blkno + nblks) as is buffered for FD into
+ * BUF.  Returns the number of bytes copied, which is a whole number
+ * of blocks unless the buffer ends at EOF.
+ */
+static long
+ra_copy(int fd, long blkno, long nblks, char *buf)
+{
+	long skip, avail;
+
+	if (fd != ra_fd || blkno < ra_blkno)
+		return 0;
+	skip = (blkno - ra_blkno) * lower->blocksize;
+	if (skip >= ra_len)
+		return 0;
+	avail = ra_len - skip;
+	if (avail > nblks * lower->blocksize)
+		avail = nblks * lower->blocksize;
+	memcpy(buf, ra_buf + skip, avail);
+	return avail;
+}
+
+
+static int
+ra_bread(int fd, long blkno, long nblks, char *buf)
+{
+	struct ra_state *st;
+	long bs = lower->blocksize;
+	long max_blks = READAHEAD_MAX / bs;
+	long done, nread;
+	int sequential;
+
+	if (fd < 0 || fd >= RA_MAX_FD || nblks <= 0)
+		return (*lower->bread)(fd, blkno, nblks, buf);
+
+	st = &ra_state[fd];
+	sequential = (blkno == st->next_blkno);
+	st->next_blkno = blkno + nblks;
+
+	done = ra_copy(fd, blkno, nblks, buf);
+	if (done == nblks * bs)
+		return done;
+	if (done % bs) {
+		/* buffered data ended at EOF */
+		return done;
+	}
+	blkno += done / bs;
+	nblks -= done / bs;
+	buf += done;
+
+	if (!sequential) {
+		st->window = 0;
+	} else {
+		/* sequential: open up the window */
+		st->window = st->window ? 2 * st->window : 2 * nblks;
+		if (st->window > max_blks)
+			st->window = max_blks;
+	}
+
+	if (st->window <= nblks) {
+		/* not sequential, or as large as our window anyway */
+		nread = (*lower->bread)(fd, blkno, nblks, buf);
+		if (nread < 0)
+			return nread;
+		return done + nread;
+	}
+
+	ra_fd = -1;
+	nread = (*lower->bread)(fd, blkno, st->window, ra_buf);
+	if (nread < 0)
+		return nread;
+#ifdef DEBUG
+	printf("readahead: fd %d, %ld blocks at %ld, got %ld bytes\n",
+	       fd, st->window, blkno, nread);
+#endif
+	ra_fd = fd;
+	ra_blkno = blkno;
+	ra_len = nread;
+
+	return done + ra_copy(fd, blkno, nblks, buf);
+}
+
+
+static int
+ra_open(const char *filename)
+{
+	int fd = (*lower->open)(filename);
+
+	/* a descriptor may be reused without an intervening close */
+	ra_forget(fd);
+	return fd;
+}
+
+
+static void
+ra_close(int fd)
+{
+	ra_forget(fd);
+	(*lower->close)(fd);
+}
+
+
+/*
+ * Return a bootfs that behaves like FS (which must already be
+ * mounted) but does sequential read-ahead on bread.
+ */
+const struct bootfs *
+readahead_fs(const struct bootfs *fs)
+{
+	int fd;
+
+	lower = fs;
+	ra_fs = *fs;
+	ra_fs.open = ra_open;
+	ra_fs.bread = ra_bread;
+	ra_fs.close = ra_close;
+
+	for (fd = 0; fd < RA_MAX_FD; ++fd)
+		ra_forget(fd);
+	ra_fd = -1;
+
+	/* allocated with the mount, so that it lives as long as FS */
+	ra_buf = malloc(READAHEAD_MAX);
+
+	return &ra_fs;
+}
@@ -125,6 +125,11 @@ main (int argc, char ** argv)
 	}
 
 	aboot_pos = iso_map (aboot_fd, 0);
+	if (aboot_pos < 0) {
+		fprintf(stderr, "%s: zisofs compressed, the SRM can't load it\n",
+			argv[2]);
+		exit(1);
+	}
 
 	printf("%s: %s is at offset %ld and is %lu bytes long\n",
 	       prog_name, argv[2], aboot_pos, aboot_size);
@@ -8,9 +8,11 @@
 
 #include "aboot.h"
 #include "cons.h"
+#include "utils.h"
 
 
 unsigned long free_mem_ptr = 0;
+static unsigned long heap_low;		/* lowest free_mem_ptr seen */
 
 
 int printf(const char *fmt, ...)
@@ -234,6 +236,14 @@ void unzip_error(char *x)
 }
 
 
+/* free_mem_ptr may also be lowered directly, as read_initrd() does */
+static void note_heap_low(void)
+{
+	if (free_mem_ptr && (!heap_low || free_mem_ptr < heap_low))
+		heap_low = free_mem_ptr;
+}
+
+
 void *malloc(size_t size)
 {
 	if (!free_mem_ptr) {
@@ -244,13 +254,90 @@ void *malloc(size_t size)
 	if ((char*) free_mem_ptr <= dest_addr + INIT_HWRPB->pagesize) {
 		error("\nout of memory");
 	}
+	note_heap_low();
 	return (void*) free_mem_ptr;
 }
 
 
 void free(void *where)
 {
-	/* don't care */
+	/* don't care, memory goes back a whole arena at a time */
+}
+
+
+/*
+ * Arenas.  malloc() only ever moves free_mem_ptr down, so memory is
+ * given back by scope instead: an arena remembers free_mem_ptr when it
+ * is entered, and leaving it releases everything allocated since,
+ * including the arenas nested in it.  Leaving an arena that has
+ * already been released along with an outer one does nothing, so an
+ * arena abandoned by a longjmp() is harmless.
+ *
+ * Anything malloc'd outside all arenas (the console sector cache, for
+ * one) stays allocated for good.
+ */
+#define ARENA_DEPTH	8
+
+static unsigned long	arena_base[ARENA_DEPTH];
+static unsigned long	arena_id[ARENA_DEPTH];
+static int		arena_top;
+static unsigned long	arena_next_id = 1;
+
+
+void arena_enter(struct arena *a, const char *name)
+{
+	if (!free_mem_ptr) {
+		free_mem_ptr = memory_end();
+	}
+
+	a->name = name;
+	a->depth = arena_top;
+	a->id = 0;
+	if (arena_top == ARENA_DEPTH) {
+		printf("aboot: arenas nested too deeply, %s not tracked\n",
+		       name);
+		return;
+	}
+	a->id = arena_next_id++;
+	arena_id[arena_top] = a->id;
+	arena_base[arena_top++] = free_mem_ptr;
+}
+
+
+/* has A been entered and not released since? */
+int arena_live(const struct arena *a)
+{
+	return a->id && a->depth < arena_top && arena_id[a->depth] == a->id;
+}
+
+
+void arena_leave(struct arena *a)
+{
+	if (!arena_live(a)) {
+		return;		/* released with an outer arena */
+	}
+	note_heap_low();
+#ifdef DEBUG
+	printf("aboot: %s arena: %ld bytes released\n", a->name,
+	       arena_base[a->depth] - free_mem_ptr);
+#endif
+	free_mem_ptr = arena_base[a->depth];
+	arena_top = a->depth;
+	a->id = 0;
+}
+
+
+void heap_report(void)
+{
+	unsigned long top;
+
+	if (!free_mem_ptr) {
+		return;
+	}
+	note_heap_low();
+	top = memory_end();
+	printf("aboot: heap: %ld kB in use, high-water mark %ld kB\n",
+	       (top - free_mem_ptr) >> 10, (top - heap_low) >> 10);
 }
 
 
@@ -33,6 +33,7 @@ extern int method;			/* compression method */
 
 extern unsigned char *inbuf;	/* input buffer */
 extern unsigned char *window;	/* sliding window and suffix table (unlzw) */
+extern unsigned char *history;	/* the window before this one */
 
 extern unsigned insize; /* valid bytes in inbuf */
 extern unsigned inptr;  /* index of next byte to be processed in inbuf */
@@ -42,6 +43,9 @@ extern unsigned outcnt; /* bytes in output buffer */
 #define	OLD_GZIP_MAGIC "\037\236" /* Magic header for gzip 0.5 = freeze 1.x */
 #define	PKZIP_MAGIC  "PK\003\004" /* Magic header for pkzip files */
 #define	PACK_MAGIC     "\037\036" /* Magic header for packed files */
+#define	LZ4_LEGACY_MAGIC "\002\041\114\030" /* 0x184c2102, little-endian */
+#define	XZ_MAGIC	 "\3757zXZ\0"	/* FD 37 7A 58 5A 00 */
+#define	ZSTD_MAGIC	 "\050\265\057\375" /* 0xfd2fb528, little-endian */
 
 /* gzip flag byte */
 #define ASCII_FLAG   0x01 /* bit 0 set: file probably ascii text */
@@ -88,8 +92,26 @@ unsigned long updcrc(unsigned char *s, unsigned n);
 int  fill_inbuf(void);
 void flush_window(void);
 void unzip_error(char *m);
+void start_input(int fd);
+unsigned long input_offset(void);
+long input_left(void);
+void get_bytes(unsigned char *buf, unsigned long n);
+unsigned char *output_direct(unsigned long len);
+void place_output(const unsigned char *buf, unsigned long n);
+void check_overlap(void);
+
+/* in unlz4.c */
+int unlz4_kernel(int fd);
+
+/* in unxz.c */
+int unxz_kernel(int fd);
+
+/* in unzstd.c */
+int unzstd_kernel(int fd);
 
 /* in inflate.c */
+extern unsigned long bb;	/* bit buffer */
+extern unsigned bk;		/* bits in bit buffer */
 int inflate(void);
 
 #endif /* GZIP_H */
@@ -8,6 +8,7 @@
  */
 
 #include "gzip.h"
+#include "utils.h"
 #define slide window
 
 void *malloc(size_t size);
@@ -38,6 +39,7 @@ struct huft {
 int huft_build (unsigned *, unsigned, unsigned, unsigned short *,
 		unsigned short *, struct huft **, int *);
 int huft_free (struct huft *);
+unsigned inflate_copy (unsigned, unsigned, unsigned);
 int inflate_codes (struct huft *, struct huft *, int, int);
 int inflate_stored (void);
 int inflate_fixed (void);
@@ -96,8 +98,20 @@ unsigned short mask_bits[] = {
 #define NEEDBITS(n) {while(k<(n)){b|=((unsigned long)NEXTBYTE())<<k;k+=8;}}
 #define DUMPBITS(n) {b>>=(n);k-=(n);}
 
-int lbits = 9;          /* bits in base literal/length lookup table */
-int dbits = 6;          /* bits in base distance lookup table */
+/* Top up the bit buffer with as many whole bytes as fit, straight from
+   inbuf (little-endian load).  Needs 8 bytes left in inbuf.  Only whole
+   bytes are added so the lookahead can still be undone byte by byte. */
+#define REFILL64 {unsigned long q_; unsigned n_ = (63 - k) >> 3; \
+  __builtin_memcpy(&q_, inbuf + inptr, sizeof(q_)); \
+  b |= (q_ << k) & ((1UL << (k + 8 * n_)) - 1); \
+  inptr += n_; k += 8 * n_;}
+
+/* Most bits a length/distance pair can take: 15-bit code plus 5 extra
+   bits for the length, 15-bit code plus 13 extra bits for the distance. */
+#define MAX_SYMBITS 48
+
+int lbits = 10;         /* bits in base literal/length lookup table */
+int dbits = 8;          /* bits in base distance lookup table */
 
 
 /*
@@ -209,6 +223,7 @@ DEBG("huft5 ");
     if ((j = *p++) != 0)
       v[x[j]++] = i;
   } while (++i < n);
+  n = x[g];                     /* set n to length of v */
 
 DEBG("h6 ");
 
@@ -344,6 +359,43 @@ struct huft *t;         /* table to free */
 }
 
 
+unsigned inflate_copy(w, d, n)
+unsigned w;             /* current window position */
+unsigned d;             /* w minus the distance, modulo WSIZE */
+unsigned n;             /* length of the match */
+/* Copy a match that may reach back into the previous window or run
+   past the end of this one, flushing the window as it fills.  Returns
+   the new window position. */
+{
+  unsigned e;           /* bytes to copy this time round */
+  unsigned char *h;     /* window a match copies from */
+
+  do {
+    n -= (e = (e = WSIZE - ((d &= WSIZE-1) > w ? d : w)) > n ? n : e);
+    h = d >= w ? history : slide;   /* previous window may live elsewhere */
+#if !defined(NOMEMCPY) && !defined(DEBUG)
+    if (w - d >= e)         /* (this test assumes unsigned comparison) */
+    {
+      memcpy(slide + w, h + d, e);
+      w += e;
+      d += e;
+    }
+    else                      /* do it slow to avoid memcpy() overlap */
+#endif /* !NOMEMCPY */
+      do {
+        slide[w++] = h[d++];
+      } while (--e);
+    if (w == WSIZE)
+    {
+      flush_output(w);
+      w = 0;
+    }
+  } while (n);
+  return w;
+}
+
+
+
 int inflate_codes(tl, td, bl, bd)
 struct huft *tl, *td;   /* literal/length and distance decoder tables */
 int bl, bd;             /* number of bits decoded by tl[] and td[] */
@@ -369,6 +421,66 @@ int bl, bd;             /* number of bits decoded by tl[] and td[] */
   md = mask_bits[bd];
   for (;;)                      /* do until end of block */
   {
+    /* Fast path: enough input buffered to decode a whole symbol from
+       the bit buffer and enough room to write a whole match without
+       reaching the end of the window.  Near those edges use the careful
+       loop below.  The inptr >= 8 test keeps the lookahead that
+       inflate() undoes at the end within the current inbuf. */
+    if (w < WSIZE - MAX_MATCH && inptr >= 8 && inptr + 8 <= insize)
+    {
+      if (k < MAX_SYMBITS)
+        REFILL64
+      if ((e = (t = tl + ((unsigned)b & ml))->e) > 16)
+        do {
+          if (e == 99)
+            return 1;
+          DUMPBITS(t->b)
+          e -= 16;
+        } while ((e = (t = t->v.t + ((unsigned)b & mask_bits[e]))->e) > 16);
+      DUMPBITS(t->b)
+      if (e == 16)              /* literal */
+      {
+        slide[w++] = (unsigned char)t->v.n;
+        continue;
+      }
+      if (e == 15)              /* end of block */
+        break;
+
+      n = t->v.n + ((unsigned)b & mask_bits[e]);
+      DUMPBITS(e)
+      if ((e = (t = td + ((unsigned)b & md))->e) > 16)
+        do {
+          if (e == 99)
+            return 1;
+          DUMPBITS(t->b)
+          e -= 16;
+        } while ((e = (t = t->v.t + ((unsigned)b & mask_bits[e]))->e) > 16);
+      DUMPBITS(t->b)
+      d = t->v.n + ((unsigned)b & mask_bits[e]);
+      DUMPBITS(e)
+
+      if (d > w)                /* reaches back into the previous window */
+      {
+        w = inflate_copy(w, w - d, n);
+        continue;
+      }
+      {
+        unsigned char *op = slide + w;
+        unsigned char *ip = op - d;
+
+        /* Whole words while they last, never past w + n: the bytes
+           beyond may still be the previous window when history is
+           slide, and a later long distance match reads them. */
+        w += n;
+        if (d >= 8)
+          for (; n >= 8; n -= 8, ip += 8, op += 8)
+            __builtin_memcpy(op, ip, 8);
+        while (n--)             /* the tail, or a short repeating pattern */
+          *op++ = *ip++;
+      }
+      continue;
+    }
+
     NEEDBITS((unsigned)bl)
     if ((e = (t = tl + ((unsigned)b & ml))->e) > 16)
       do {
@@ -415,26 +527,7 @@ int bl, bd;             /* number of bits decoded by tl[] and td[] */
       DUMPBITS(e)
 
       /* do the copy */
-      do {
-        n -= (e = (e = WSIZE - ((d &= WSIZE-1) > w ? d : w)) > n ? n : e);
-#if !defined(NOMEMCPY) && !defined(DEBUG)
-        if (w - d >= e)         /* (this test assumes unsigned comparison) */
-        {
-          memcpy(slide + w, slide + d, e);
-          w += e;
-          d += e;
-        }
-        else                      /* do it slow to avoid memcpy() overlap */
-#endif /* !NOMEMCPY */
-          do {
-            slide[w++] = slide[d++];
-          } while (--e);
-        if (w == WSIZE)
-        {
-          flush_output(w);
-          w = 0;
-        }
-      } while (n);
+      w = inflate_copy(w, d, n);
     }
   }
 
@@ -791,6 +884,7 @@ int inflate()
   int e;                /* last block flag */
   int r;                /* result code */
   unsigned h;           /* maximum struct huft's malloc'ed */
+  struct arena block;   /* gives back the block's huft tables */
 
 
   /* initialize window, bit buffer */
@@ -803,7 +897,10 @@ int inflate()
   h = 0;
   do {
     hufts = 0;
-    if ((r = inflate_block(&e)) != 0)
+    arena_enter(&block, "inflate block");
+    r = inflate_block(&e);
+    arena_leave(&block);
+    if (r != 0)
       return r;
     if (hufts > h)
       h = hufts;
@@ -11,6 +11,7 @@
  */
 #include "aboot.h"
 #include "bootfs.h"
+#include "prof.h"
 #include "setjmp.h"
 #include "utils.h"
 #include "gzip.h"
@@ -18,6 +19,7 @@
 
 unsigned char *inbuf;
 unsigned char *window;
+unsigned char *history;
 unsigned outcnt;
 unsigned insize;
 unsigned inptr;
@@ -26,9 +28,16 @@ int method;
 
 static int block_number = 0;
 static int input_fd = -1;
+static long input_size;		  /* compressed size, -1 if not known */
+static unsigned long in_base;	  /* file offset of inbuf[0] */
 static int chunk;                 /* current segment */
+static unsigned char *bounce;     /* window when not inflating in place */
 size_t file_offset;
 
+static unsigned char *mem_dst;	  /* inflate_buffer() output, NULL if none */
+static unsigned long mem_room;	  /* bytes left at mem_dst */
+static unsigned char *mem_spill;  /* window once mem_room runs short */
+
 static const unsigned int crc_32_tab[256] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
 	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
@@ -96,6 +105,79 @@ static const unsigned int crc_32_tab[256] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
 };
 
+/*
+ * Slice-by-8 tables: crc_tab[k][i] is the crc of byte i followed by k
+ * zero bytes, so eight table lookups retire a whole quadword.  Built
+ * from crc_32_tab when a decompression starts.
+ */
+static unsigned int (*crc_tab)[256];
+static unsigned long crc = 0xffffffffUL; /* shift register contents */
+
+static void
+crc_init(void)
+{
+	int i, k;
+
+	if (crc_tab)
+		return;
+	crc_tab = malloc(8 * sizeof(*crc_tab));
+	for (i = 0; i < 256; i++) {
+		unsigned int c = crc_32_tab[i];
+
+		crc_tab[0][i] = c;
+		for (k = 1; k < 8; k++) {
+			c = crc_32_tab[c & 0xff] ^ (c >> 8);
+			crc_tab[k][i] = c;
+		}
+	}
+}
+
+/* fold the little-endian quadword w into shift register c */
+static inline unsigned long
+crc_word(unsigned long c, unsigned long w)
+{
+	w ^= c;
+	return crc_tab[7][w & 0xff] ^ crc_tab[6][(w >> 8) & 0xff]
+		^ crc_tab[5][(w >> 16) & 0xff] ^ crc_tab[4][(w >> 24) & 0xff]
+		^ crc_tab[3][(w >> 32) & 0xff] ^ crc_tab[2][(w >> 40) & 0xff]
+		^ crc_tab[1][(w >> 48) & 0xff] ^ crc_tab[0][w >> 56];
+}
+
+/*
+ * Copy N bytes from S to D (unless D is NULL) and run them through the
+ * crc shift register in the same pass.
+ */
+static void
+crc_copy(unsigned char *d, const unsigned char *s, unsigned long n)
+{
+	register unsigned long c = crc;
+	unsigned long w;
+
+	/* align the source, then do a quadword at a time */
+	while (n && ((unsigned long) s & 7)) {
+		if (d)
+			*d++ = *s;
+		c = crc_32_tab[((int)c ^ (*s++)) & 0xff] ^ (c >> 8);
+		n--;
+	}
+	while (n >= 8) {
+		w = *(const unsigned long *) s;
+		if (d) {
+			__builtin_memcpy(d, &w, 8);
+			d += 8;
+		}
+		c = crc_word(c, w);
+		s += 8;
+		n -= 8;
+	}
+	while (n--) {
+		if (d)
+			*d++ = *s;
+		c = crc_32_tab[((int)c ^ (*s++)) & 0xff] ^ (c >> 8);
+	}
+	crc = c;
+}
+
 /*
  * Run a set of bytes through the crc shift register.  If s is a NULL
  * pointer, then initialize the crc shift register contents instead.
@@ -108,19 +190,13 @@ static const unsigned int crc_32_tab[256] = {
 unsigned long
 updcrc(unsigned char *s, unsigned n)
 {
-	register unsigned long c;
-	static unsigned long crc = 0xffffffffUL; /* shift register contents */
-
 	if (!s) {
-		c = 0xffffffffL;
+		crc_init();
+		crc = 0xffffffffL;
 	} else {
-		c = crc;
-		while (n--) {
-			c = crc_32_tab[((int)c ^ (*s++)) & 0xff] ^ (c >> 8);
-		}
+		crc_copy(NULL, s, n);
 	}
-	crc = c;
-	return c ^ 0xffffffffL;       /* (instead of ~c for 64-bit machines) */
+	return crc ^ 0xffffffffL;     /* (instead of ~c for 64-bit machines) */
 }
 
 
@@ -133,6 +209,7 @@ clear_bufs(void)
 	outcnt = 0;
 	insize = inptr = 0;
 	block_number = 0;
+	in_base = 0;
 	bytes_out = 0;
 	chunk = 0;
 	file_offset = 0;
@@ -209,6 +286,12 @@ fill_inbuf(void)
 {
 	long nblocks, nread;
 
+	if (mem_dst) {
+		/* inflate_buffer() handed over all there is */
+		unzip_error("zlib stream truncated");	/* does a longjmp() */
+		return 0;
+	}
+
 	if (INBUFSIZ % bfs->blocksize != 0) {
 		printf("INBUFSIZ (%d) is not multiple of block-size (%d)\n",
 		       INBUFSIZ, bfs->blocksize);
@@ -220,7 +303,10 @@ fill_inbuf(void)
 	}
 
 	nblocks = INBUFSIZ / bfs->blocksize;
+	in_base = block_number * bfs->blocksize;
+	prof_start(PROF_KERNEL_READ);
 	nread = (*bfs->bread)(input_fd, block_number, nblocks, (char *) inbuf);
+	prof_stop(PROF_KERNEL_READ);
 #ifdef DEBUG
 	printf("read %ld blocks of %d, got %ld\n", nblocks, bfs->blocksize,
 	       nread);
@@ -248,8 +334,147 @@ fill_inbuf(void)
 
 
 /*
- * Write the output window window[0..outcnt-1] holding uncompressed
- * data and update crc.
+ * Copy src[0..n-1], which starts at file_offset in the uncompressed
+ * image, to where it belongs in the loadable segments.  With CRC set
+ * the crc is updated on the way so that each byte is touched once.
+ */
+static void
+place(const unsigned char *src, size_t n, int crc)
+{
+	size_t start = file_offset, end = file_offset + n;
+	size_t done = start;	/* bytes before this are checksummed */
+	unsigned char *dest;
+
+	while (chunk < nchunks) {
+		size_t seg_start = chunks[chunk].offset;
+		size_t seg_end = seg_start + chunks[chunk].size;
+		size_t from, to;
+
+		if (seg_start >= end)
+			break;	/* segment starts in a later window */
+
+		from = start > seg_start ? start : seg_start;
+		to = end < seg_end ? end : seg_end;
+		if (from < to) {
+			/* print a vanity message */
+			if (from == seg_start)
+				printf("aboot: segment %d, %ld bytes at %#lx\n",
+				       chunk, chunks[chunk].size,
+				       chunks[chunk].addr);
+#ifdef DEBUG
+			printf("copying %ld bytes from offset %#lx "
+			       "(segment %d) to %#lx\n",
+			       to - from, from, chunk,
+			       chunks[chunk].addr + (from - seg_start));
+#endif
+			if (crc && done < from)
+				crc_copy(NULL, src + (done - start),
+					 from - done);
+#ifndef TESTING
+			dest = (unsigned char *) chunks[chunk].addr
+				+ (from - seg_start);
+#else
+			dest = NULL;
+#endif
+			if (crc)
+				crc_copy(dest, src + (from - start), to - from);
+			else if (dest)
+				memcpy(dest, src + (from - start), to - from);
+			done = to;
+		}
+		if (seg_end > end)
+			break;	/* rest of the segment is in later windows */
+		chunk++;
+	}
+	if (crc && done < end)
+		crc_copy(NULL, src + (done - start), end - done);
+}
+
+
+/*
+ * If the next LEN bytes of output, starting at file_offset, all fall
+ * inside one segment, return the address they are loaded at so that
+ * the decoder can write them there directly.  Returns NULL when the
+ * range straddles a segment boundary or gap.
+ */
+static unsigned char *
+segment_at(size_t len)
+{
+#ifndef TESTING
+	size_t start = file_offset, end = file_offset + len;
+	int i;
+
+	for (i = chunk; i < nchunks; i++) {
+		size_t seg_start = chunks[i].offset;
+		size_t seg_end = seg_start + chunks[i].size;
+
+		if (seg_end <= start)
+			continue;
+		if (seg_start > start || seg_end < end)
+			break;
+
+		chunk = i;
+		if (start == seg_start)
+			printf("aboot: segment %d, %ld bytes at %#lx\n",
+			       chunk, chunks[chunk].size,
+			       chunks[chunk].addr);
+#ifdef DEBUG
+		printf("decoding offset %#lx (segment %d) in place\n",
+		       start, chunk);
+#endif
+		return (unsigned char *) chunks[i].addr + (start - seg_start);
+	}
+#endif
+	return NULL;
+}
+
+
+/*
+ * Window for the next output of inflate_buffer(): straight in the
+ * destination while a whole window fits there.  With the destination
+ * full the stream has to end, so the window just flushed will do.
+ */
+static unsigned char *
+buffer_window(void)
+{
+	if (mem_room >= WSIZE)
+		return mem_dst;
+	if (!mem_room && window)
+		return window;
+	if (!mem_spill)
+		mem_spill = malloc(WSIZE);
+	return mem_spill;
+}
+
+
+/*
+ * flush_window() for inflate_buffer(): move the window to the
+ * destination unless it was inflated there.
+ */
+static void
+flush_buffer(void)
+{
+	if (outcnt > mem_room) {
+		unzip_error("zlib stream too long");	/* does a longjmp() */
+		outcnt = mem_room;
+	}
+	if (window != mem_dst)
+		memcpy(mem_dst, window, outcnt);
+	mem_dst += outcnt;
+	mem_room -= outcnt;
+
+	history = window;
+	window = buffer_window();
+}
+
+
+/*
+ * The output window window[0..outcnt-1] holds uncompressed data:
+ * update crc, move it into place if it was inflated into the bounce
+ * buffer and set up the next window.  When the whole next window lies
+ * inside one segment, inflate writes it straight to its final location.
+ * The window just completed stays untouched and serves as history for
+ * matches reaching back into it.
  */
 void
 flush_window(void)
@@ -258,60 +483,177 @@ flush_window(void)
 		return;
 	}
 
-	updcrc(window, outcnt);
+	if (mem_dst) {
+		flush_buffer();
+		return;
+	}
 
 	if (!bytes_out) /* first block - look for headers */
 		if (!is_loadable_elf(window, outcnt))
 			unzip_error("invalid exec header"); /* does a longjmp() */
 
 	bytes_out += outcnt;
-	while (chunk < nchunks) {
-		/* position within the current segment */
-		ssize_t chunk_offset = file_offset - chunks[chunk].offset;
-		unsigned char *dest =
-			(unsigned char *) chunks[chunk].addr + chunk_offset;
-		ssize_t to_copy;
-		unsigned char *src = window;
-
-		/* window overlaps beginning of current segment */
-		if (chunk_offset < 0) {
-			src = window - chunk_offset;
-			dest = (unsigned char *) chunks[chunk].addr;
-		}
-		if (src - window >= outcnt) {
-			file_offset += outcnt;
-			break; /* next window */
-		}
+	prof_start(PROF_CRC);
+	if (window == bounce)
+		place(window, outcnt, 1);	/* also updates the crc */
+	else
+		updcrc(window, outcnt);
+	prof_stop(PROF_CRC);
+	file_offset += outcnt;
+
+	history = window;
+	window = segment_at(WSIZE);
+	if (!window)
+		window = bounce;
+}
 
-		/* print a vanity message */
-		if (chunk_offset == 0)
-			printf("aboot: segment %d, %ld bytes at %#lx\n",
-			       chunk, chunks[chunk].size,
-			       chunks[chunk].addr);
 
-		to_copy = chunks[chunk].offset + chunks[chunk].size
-			- file_offset;
-		if (to_copy > outcnt)
-			to_copy = outcnt;
-#ifdef DEBUG
-		printf("copying %ld bytes from offset %#lx "
-		       "(segment %d) to %p\n",
-		       to_copy, file_offset, chunk, dest);
-#endif
+/*
+ * Output interface for the decoders other than inflate, which have
+ * no crc of their own over the whole image.  output_direct() asks for
+ * room to decode the next LEN bytes in place, place_output() hands
+ * decoded data over, copying it into the segments unless it was
+ * decoded in place.
+ */
+static const unsigned char *direct_out;
+
+unsigned char *
+output_direct(unsigned long len)
+{
+	if (!bytes_out)
+		return NULL;	/* segments unknown until the ELF header */
+	direct_out = segment_at(len);
+	return (unsigned char *) direct_out;
+}
+
+
+/*
+ * With the ELF header parsed, make sure that loading the segments
+ * cannot clobber the heap, which holds the decoder's buffers, or the
+ * other way round.  malloc() itself only checks against dest_addr,
+ * which is 0 for ELF images.  Decoders that allocate more once output
+ * has started call this again.
+ */
+void
+check_overlap(void)
+{
 #ifndef TESTING
-		memcpy(dest, src, to_copy);
+	unsigned long end = (unsigned long) bss_start + bss_size;
+	int i;
+
+	for (i = 0; i < nchunks; i++)
+		if (chunks[i].addr + chunks[i].size > end)
+			end = chunks[i].addr + chunks[i].size;
+	if (free_mem_ptr && end > free_mem_ptr && start_addr < memory_end())
+		unzip_error("kernel overlaps the decompression buffers");
 #endif
-		file_offset += to_copy;
+}
 
-		if (to_copy < outcnt) {
-#ifdef DEBUG
-			printf("new segment or EOF\n");
-#endif
-			outcnt -= to_copy;
-			chunk++;
-		} else
-			break; /* done this window */
- 	}
+
+void
+place_output(const unsigned char *buf, unsigned long n)
+{
+	if (!n)
+		return;
+
+	if (!bytes_out) { /* first block - look for headers */
+		if (!is_loadable_elf(buf, n))
+			unzip_error("invalid exec header"); /* does a longjmp() */
+		check_overlap();
+	}
+
+	bytes_out += n;
+	if (buf != direct_out) {
+		prof_start(PROF_CRC);
+		place(buf, n, 0);
+		prof_stop(PROF_CRC);
+	}
+	direct_out = NULL;
+	file_offset += n;
+}
+
+
+/*
+ * Offset in the input file of the next byte to be consumed.
+ */
+unsigned long
+input_offset(void)
+{
+	return in_base + inptr;
+}
+
+
+/*
+ * Number of input bytes not consumed yet, or -1 if the size of the
+ * input file is not known.
+ */
+long
+input_left(void)
+{
+	if (input_size < 0)
+		return -1;
+	return input_size - (long) input_offset();
+}
+
+
+/*
+ * Read the next N input bytes into BUF.  Once inbuf is drained, whole
+ * blocks go straight from bread into BUF.
+ */
+void
+get_bytes(unsigned char *buf, unsigned long n)
+{
+	unsigned long avail, nblocks;
+	long nread;
+
+	while (n) {
+		if (inptr < insize) {
+			avail = insize - inptr;
+			if (avail > n)
+				avail = n;
+			memcpy(buf, inbuf + inptr, avail);
+			inptr += avail;
+			buf += avail;
+			n -= avail;
+		} else if (n >= (unsigned long) bfs->blocksize
+			   && block_number >= 0)
+		{
+			nblocks = n / bfs->blocksize;
+			prof_start(PROF_KERNEL_READ);
+			nread = (*bfs->bread)(input_fd, block_number, nblocks,
+					      (char *) buf);
+			prof_stop(PROF_KERNEL_READ);
+			if (nread != (long) nblocks * bfs->blocksize)
+				unzip_error("read error");
+			block_number += nblocks;
+			in_base = block_number * bfs->blocksize;
+			insize = inptr = 0;
+			buf += nread;
+			n -= nread;
+		} else {
+			fill_inbuf();
+			inptr = 0;
+		}
+	}
+}
+
+
+/*
+ * Get ready to decode the file FD from its first byte.
+ */
+void
+start_input(int fd)
+{
+	struct stat st;
+
+	input_fd = fd;
+	inbuf = malloc(INBUFSIZ);
+	crc_tab = NULL;		/* the last one went with its arena */
+	clear_bufs();
+
+	input_size = -1;
+	if (fd >= 0 && bfs->fstat && (*bfs->fstat)(fd, &st) >= 0)
+		input_size = st.st_size;
 }
 
 
@@ -332,15 +674,120 @@ flush_window(void)
 int
 uncompress_kernel(int fd)
 {
-	input_fd = fd;
+	start_input(fd);
 
-	inbuf = malloc(INBUFSIZ);
-	window = malloc(WSIZE);
-
-	clear_bufs();
+	bounce = malloc(WSIZE);
+	window = history = bounce;
 
 	method = get_method();
 	unzip(0, 0);
 
 	return 1;
 }
+
+
+/*
+ * The adler32 checksum of a zlib stream.
+ */
+static unsigned long
+adler32(const unsigned char *p, unsigned long n)
+{
+	unsigned long a = 1, b = 0, k;
+
+	while (n) {
+		k = n < 5552 ? n : 5552;	/* b can't overflow 32 bits */
+		n -= k;
+		while (k--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+
+/*
+ * Inflate the zlib stream SRC[0..SRCLEN-1] into DST, which has room
+ * for DSTLEN bytes.  Returns the number of bytes produced, or -1 if
+ * the stream is corrupt or doesn't fit.  zisofs compresses each block
+ * of a file this way (see iso_inflate in lib/isolib.c).  The state of
+ * a decompression in progress is saved around the call, since a
+ * kernel read from a compressed file gets here from fill_inbuf().
+ */
+long
+inflate_buffer(const unsigned char *src, long srclen,
+	       unsigned char *dst, long dstlen)
+{
+	unsigned char *old_inbuf = inbuf, *old_window = window;
+	unsigned char *old_history = history;
+	unsigned old_insize = insize, old_inptr = inptr, old_outcnt = outcnt;
+	unsigned long old_bb = bb;
+	unsigned old_bk = bk;
+	jmp_buf old_jump;
+	long res = -1;
+
+	/* 2 byte zlib header: deflate, no preset dictionary */
+	if (srclen < 2 || (src[0] & 0x0f) != DEFLATED
+	    || ((src[0] << 8) | src[1]) % 31 != 0 || (src[1] & 0x20))
+		return -1;
+
+	memcpy(old_jump, jump_buffer, sizeof(jmp_buf));
+	inbuf = (unsigned char *) src;
+	insize = srclen;
+	inptr = 2;
+	mem_dst = dst;
+	mem_room = dstlen;
+	mem_spill = NULL;
+	window = NULL;
+	window = history = buffer_window();
+
+	if (!_setjmp(jump_buffer) && inflate() == 0 && inptr + 4 <= insize
+	    && adler32(dst, mem_dst - dst) == ((unsigned long) inbuf[inptr] << 24
+					       | inbuf[inptr + 1] << 16
+					       | inbuf[inptr + 2] << 8
+					       | inbuf[inptr + 3]))
+		res = mem_dst - dst;
+
+	mem_dst = NULL;
+	memcpy(jump_buffer, old_jump, sizeof(jmp_buf));
+	inbuf = old_inbuf;
+	insize = old_insize;
+	inptr = old_inptr;
+	window = old_window;
+	history = old_history;
+	outcnt = old_outcnt;
+	bb = old_bb;
+	bk = old_bk;
+	return res;
+}
+
+
+/*
+ * Compressed kernel formats, recognized by their leading magic.
+ */
+static const struct decompressor decompressors[] = {
+	{"gzip compressed",	GZIP_MAGIC,		2, uncompress_kernel},
+	{"gzip compressed",	OLD_GZIP_MAGIC,		2, uncompress_kernel},
+	{"lz4 compressed",	LZ4_LEGACY_MAGIC,	4, unlz4_kernel},
+	{"xz compressed",	XZ_MAGIC,		6, unxz_kernel},
+	{"zstd compressed",	ZSTD_MAGIC,		4, unzstd_kernel},
+};
+
+
+const struct decompressor *
+find_decompressor(const unsigned char *buf, long len)
+{
+	int i;
+
+	for (i = 0; i < (int) (sizeof(decompressors)/sizeof(decompressors[0]));
+	     ++i)
+	{
+		if (len >= decompressors[i].magic_len
+		    && memcmp(buf, decompressors[i].magic,
+			      decompressors[i].magic_len) == 0)
+			return &decompressors[i];
+	}
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * unlz4.c
+ *
+ * Decoder for kernels compressed with "lz4 -l", the legacy LZ4 frame
+ * format also used by the Linux kernel build: a 4-byte magic followed
+ * by independently compressed blocks, each preceded by its compressed
+ * size and expanding to at most 8MB.  The kernel build appends the
+ * uncompressed size after the last block.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ */
+#include "aboot.h"
+#include "bootfs.h"
+#include "utils.h"
+#include "gzip.h"
+
+#define LZ4_MAGIC	0x184c2102
+#define LZ4_BLOCK_SIZE	(8 << 20)	/* uncompressed size of a block */
+#define LZ4_BOUND(n)	((n) + (n) / 255 + 16)	/* worst case compressed */
+
+#define MINMATCH	4
+
+
+static unsigned long
+get_le32(void)
+{
+	unsigned char b[4];
+
+	get_bytes(b, 4);
+	return b[0] | b[1] << 8 | b[2] << 16 | (unsigned long) b[3] << 24;
+}
+
+
+/*
+ * Decode one LZ4 block from SRC[0..SRCLEN-1] into DST, which has room
+ * for DSTLEN bytes.  Returns the decoded size or -1 if the block is
+ * corrupt.
+ */
+static long
+lz4_decode_block(const unsigned char *src, long srclen,
+		 unsigned char *dst, long dstlen)
+{
+	const unsigned char *ip = src, *iend = src + srclen;
+	unsigned char *op = dst, *oend = dst + dstlen;
+	const unsigned char *match;
+	unsigned long len, off;
+	unsigned int token, c;
+
+	for (;;) {
+		if (ip >= iend)
+			return -1;
+		token = *ip++;
+
+		/* literals */
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				c = *ip++;
+				len += c;
+			} while (c == 255);
+		}
+		if (len > (unsigned long) (iend - ip)
+		    || len > (unsigned long) (oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break;		/* last sequence has no match */
+
+		/* match */
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > (unsigned long) (op - dst))
+			return -1;
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				c = *ip++;
+				len += c;
+			} while (c == 255);
+		}
+		len += MINMATCH;
+		if (len > (unsigned long) (oend - op))
+			return -1;
+
+		match = op - off;
+		if (off >= 8 && len + 8 <= (unsigned long) (oend - op)) {
+			/* a word at a time, may overshoot by up to 7 bytes */
+			unsigned char *end = op + len;
+			unsigned long w;
+
+			do {
+				__builtin_memcpy(&w, match, sizeof(w));
+				__builtin_memcpy(op, &w, sizeof(w));
+				match += 8;
+				op += 8;
+			} while (op < end);
+			op = end;
+		} else {
+			while (len--)
+				*op++ = *match++;
+		}
+	}
+	return op - dst;
+}
+
+
+int
+unlz4_kernel(int fd)
+{
+	unsigned char *cbuf, *obuf, *dst;
+	unsigned long csize;
+	long left, n;
+
+	start_input(fd);
+	if (get_le32() != LZ4_MAGIC)
+		unzip_error("bad lz4 magic");
+
+	/*
+	 * About 16MB between them: allocated before the first block so
+	 * that place_output() checks them against the kernel segments.
+	 */
+	cbuf = malloc(LZ4_BOUND(LZ4_BLOCK_SIZE));
+	obuf = malloc(LZ4_BLOCK_SIZE);
+
+	while ((left = input_left()) != 0) {
+		if (left > 0 && left < 4)
+			break;		/* trailing garbage */
+		csize = get_le32();
+		if (csize == LZ4_MAGIC)
+			continue;	/* concatenated stream */
+		if (input_left() == 0)
+			break;		/* appended uncompressed size */
+		if (csize == 0 || csize > LZ4_BOUND(LZ4_BLOCK_SIZE)) {
+			if (left < 0)
+				break;	/* no file size: assume the end */
+			unzip_error("bad lz4 block size");
+		}
+		if (left > 0 && (long) csize > input_left())
+			unzip_error("truncated lz4 block");
+
+		get_bytes(cbuf, csize);
+		dst = output_direct(LZ4_BLOCK_SIZE);
+		if (!dst)
+			dst = obuf;
+		n = lz4_decode_block(cbuf, csize, dst, LZ4_BLOCK_SIZE);
+		if (n < 0)
+			unzip_error("corrupt lz4 block");
+		place_output(dst, n);
+	}
+	if (!bytes_out)
+		unzip_error("empty lz4 file");
+	return 1;
+}
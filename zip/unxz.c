@@ -0,0 +1,668 @@
+/*
+ * unxz.c
+ *
+ * Streaming decoder for xz-compressed kernels.  Only what kernel images
+ * need is supported: a single xz stream whose blocks use the LZMA2
+ * filter alone, with a CRC32, CRC64, SHA-256 or no integrity check
+ * (SHA-256 is skipped, not verified).
+ *
+ * The LZMA dictionary is a circular buffer sized from the block's
+ * LZMA2 properties, shrunk to the block's uncompressed size when the
+ * header records it and never larger than XZ_DICT_MAX.  Decoded data
+ * is flushed from it into the kernel segments with place_output().
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ */
+#include "aboot.h"
+#include "bootfs.h"
+#include "config.h"
+#include "utils.h"
+#include "gzip.h"
+
+#define XZ_HEADER_SIZE	12
+#define XZ_CHECK_NONE	0
+#define XZ_CHECK_CRC32	1
+#define XZ_CHECK_CRC64	4
+#define XZ_CHECK_SHA256	10
+#define XZ_FILTER_LZMA2	0x21
+
+#define LZMA2_CHUNK_MAX	(64*1024)	/* largest compressed chunk */
+
+/* LZMA model sizes */
+#define STATES		12
+#define LIT_STATES	7
+#define POS_STATES_MAX	(1 << 4)
+#define LEN_LOW_BITS	3
+#define LEN_MID_BITS	3
+#define LEN_HIGH_BITS	8
+#define DIST_STATES	4
+#define DIST_SLOT_BITS	6
+#define DIST_MODEL_START 4
+#define DIST_MODEL_END	14
+#define FULL_DISTANCES	(1 << (DIST_MODEL_END / 2))
+#define ALIGN_BITS	4
+#define MATCH_LEN_MIN	2
+#define LITERAL_CODER_SIZE 0x300
+#define LITERAL_CODERS_MAX (1 << 4)	/* lc + lp <= 4 in LZMA2 */
+
+#define RC_BIT_MODEL_TOTAL_BITS 11
+#define RC_BIT_MODEL_TOTAL (1 << RC_BIT_MODEL_TOTAL_BITS)
+#define RC_MOVE_BITS	5
+#define RC_TOP_VALUE	(1 << 24)
+
+struct len_dec {
+	unsigned short choice;
+	unsigned short choice2;
+	unsigned short low[POS_STATES_MAX][1 << LEN_LOW_BITS];
+	unsigned short mid[POS_STATES_MAX][1 << LEN_MID_BITS];
+	unsigned short high[1 << LEN_HIGH_BITS];
+};
+
+static struct lzma_probs {
+	unsigned short is_match[STATES][POS_STATES_MAX];
+	unsigned short is_rep[STATES];
+	unsigned short is_rep0[STATES];
+	unsigned short is_rep1[STATES];
+	unsigned short is_rep2[STATES];
+	unsigned short is_rep0_long[STATES][POS_STATES_MAX];
+	unsigned short dist_slot[DIST_STATES][1 << DIST_SLOT_BITS];
+	unsigned short dist_special[FULL_DISTANCES - DIST_MODEL_END];
+	unsigned short dist_align[1 << ALIGN_BITS];
+	struct len_dec match_len;
+	struct len_dec rep_len;
+	unsigned short literal[LITERAL_CODERS_MAX][LITERAL_CODER_SIZE];
+} *p;
+
+/* LZMA state carried from chunk to chunk */
+static unsigned int state;
+static unsigned long rep0, rep1, rep2, rep3;
+static unsigned int lc, lp_mask, pb_mask;
+
+/* range decoder, over one compressed chunk held in memory */
+static const unsigned char *rc_in, *rc_end;
+static unsigned int rc_range, rc_code;
+
+/* circular dictionary */
+static unsigned char *dict;
+static unsigned long dict_alloc;	/* bytes malloc'd for dict */
+static unsigned long dict_size;		/* bytes in use for this block */
+static unsigned long dict_pos;		/* next byte written */
+static unsigned long dict_start;	/* first byte not flushed yet */
+static unsigned long dict_full;		/* valid history, <= dict_size */
+static unsigned long total_out;		/* bytes since the dictionary reset */
+
+static unsigned char *cbuf;		/* one compressed chunk */
+
+static int check_type;
+static unsigned int xz_crc32;		/* running crc32 of the block */
+static unsigned long xz_crc64;		/* running crc64 of the block */
+static unsigned long *crc64_tab;
+
+
+static void
+crc64_init(void)
+{
+	unsigned long c;
+	int i, k;
+
+	if (crc64_tab)
+		return;
+	crc64_tab = malloc(256 * sizeof(*crc64_tab));
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c >> 1) ^ (0xc96c5795d7870f42UL & -(c & 1));
+		crc64_tab[i] = c;
+	}
+}
+
+
+/* update the block check over decoded bytes BUF[0..N-1] */
+static void
+check_update(const unsigned char *buf, unsigned long n)
+{
+	unsigned long c;
+
+	if (check_type == XZ_CHECK_CRC32) {
+		xz_crc32 = updcrc((unsigned char *) buf, n);
+	} else if (check_type == XZ_CHECK_CRC64) {
+		c = ~xz_crc64;
+		while (n--)
+			c = crc64_tab[(c ^ *buf++) & 0xff] ^ (c >> 8);
+		xz_crc64 = ~c;
+	}
+}
+
+
+/* hand everything decoded since the last flush to the loader */
+static void
+dict_flush(void)
+{
+	unsigned long n = dict_pos - dict_start;
+
+	if (!n)
+		return;
+	check_update(dict + dict_start, n);
+	place_output(dict + dict_start, n);
+	if (dict_pos == dict_size)
+		dict_pos = 0;
+	dict_start = dict_pos;
+}
+
+
+static inline void
+dict_put(unsigned char c)
+{
+	dict[dict_pos++] = c;
+	if (dict_full < dict_size)
+		dict_full++;
+	total_out++;
+	if (dict_pos == dict_size)
+		dict_flush();
+}
+
+
+/* byte DIST + 1 positions back */
+static inline unsigned char
+dict_get(unsigned long dist)
+{
+	unsigned long i = dict_pos - dist - 1;
+
+	if (dist >= dict_pos)
+		i += dict_size;
+	return dict[i];
+}
+
+
+static void
+dict_repeat(unsigned long dist, unsigned long len)
+{
+	while (len--)
+		dict_put(dict_get(dist));
+}
+
+
+static void
+rc_init(void)
+{
+	int i;
+
+	if (rc_end - rc_in < 5 || *rc_in++ != 0)
+		unzip_error("xz: bad range coder header");
+	rc_range = 0xffffffff;
+	rc_code = 0;
+	for (i = 0; i < 4; i++)
+		rc_code = rc_code << 8 | *rc_in++;
+}
+
+
+static inline void
+rc_normalize(void)
+{
+	if (rc_range < RC_TOP_VALUE) {
+		if (rc_in >= rc_end)
+			unzip_error("xz: compressed chunk too short");
+		rc_range <<= 8;
+		rc_code = rc_code << 8 | *rc_in++;
+	}
+}
+
+
+static inline int
+rc_bit(unsigned short *prob)
+{
+	unsigned int bound;
+
+	rc_normalize();
+	bound = (rc_range >> RC_BIT_MODEL_TOTAL_BITS) * *prob;
+	if (rc_code < bound) {
+		rc_range = bound;
+		*prob += (RC_BIT_MODEL_TOTAL - *prob) >> RC_MOVE_BITS;
+		return 0;
+	}
+	rc_range -= bound;
+	rc_code -= bound;
+	*prob -= *prob >> RC_MOVE_BITS;
+	return 1;
+}
+
+
+static unsigned int
+rc_bittree(unsigned short *probs, unsigned int limit)
+{
+	unsigned int symbol = 1;
+
+	do {
+		symbol = symbol << 1 | rc_bit(&probs[symbol]);
+	} while (symbol < limit);
+	return symbol - limit;
+}
+
+
+static void
+rc_bittree_reverse(unsigned short *probs, unsigned long *dest,
+		   unsigned int limit)
+{
+	unsigned int symbol = 1, i = 0;
+
+	do {
+		if (rc_bit(&probs[symbol])) {
+			symbol = (symbol << 1) + 1;
+			*dest += 1UL << i;
+		} else {
+			symbol <<= 1;
+		}
+	} while (++i < limit);
+}
+
+
+static void
+rc_direct(unsigned long *dest, unsigned int limit)
+{
+	unsigned int mask;
+
+	do {
+		rc_normalize();
+		rc_range >>= 1;
+		rc_code -= rc_range;
+		mask = 0 - (rc_code >> 31);
+		rc_code += rc_range & mask;
+		*dest = (*dest << 1) + (mask + 1);
+	} while (--limit);
+}
+
+
+static void
+lzma_reset(void)
+{
+	unsigned short *prob = (unsigned short *) p;
+	unsigned long i;
+
+	for (i = 0; i < sizeof(*p) / sizeof(*prob); i++)
+		prob[i] = RC_BIT_MODEL_TOTAL / 2;
+	state = 0;
+	rep0 = rep1 = rep2 = rep3 = 0;
+}
+
+
+static int
+lzma_props(unsigned int props)
+{
+	unsigned int pb, lp;
+
+	if (props > (4 * 5 + 4) * 9 + 8)
+		return -1;
+	pb = props / (9 * 5);
+	props -= pb * 9 * 5;
+	lp = props / 9;
+	lc = props - lp * 9;
+	if (lc + lp > 4)
+		return -1;
+	pb_mask = (1 << pb) - 1;
+	lp_mask = (1 << lp) - 1;
+	return 0;
+}
+
+
+static unsigned int
+lzma_len(struct len_dec *l, unsigned int pos_state)
+{
+	if (!rc_bit(&l->choice))
+		return rc_bittree(l->low[pos_state], 1 << LEN_LOW_BITS);
+	if (!rc_bit(&l->choice2))
+		return (1 << LEN_LOW_BITS)
+			+ rc_bittree(l->mid[pos_state], 1 << LEN_MID_BITS);
+	return (1 << LEN_LOW_BITS) + (1 << LEN_MID_BITS)
+		+ rc_bittree(l->high, 1 << LEN_HIGH_BITS);
+}
+
+
+static void
+lzma_literal(void)
+{
+	unsigned short *probs;
+	unsigned int prev = dict_full ? dict_get(0) : 0;
+	unsigned int symbol = 1, match_byte, match_bit, offset;
+
+	probs = p->literal[((total_out & lp_mask) << lc) + (prev >> (8 - lc))];
+	if (state < LIT_STATES) {
+		symbol = rc_bittree(probs, 0x100);
+	} else {
+		match_byte = dict_get(rep0);
+		offset = 0x100;
+		do {
+			match_byte <<= 1;
+			match_bit = match_byte & offset;
+			if (rc_bit(&probs[offset + match_bit + symbol])) {
+				symbol = (symbol << 1) | 1;
+				offset &= match_bit;
+			} else {
+				symbol <<= 1;
+				offset &= ~match_bit;
+			}
+		} while (symbol < 0x100);
+		symbol -= 0x100;
+	}
+	dict_put(symbol);
+
+	if (state < 4)
+		state = 0;
+	else if (state < 10)
+		state -= 3;
+	else
+		state -= 6;
+}
+
+
+/* decode a plain match, leaving its distance in rep0; returns length */
+static unsigned int
+lzma_match(unsigned int pos_state)
+{
+	unsigned int len, slot, limit;
+
+	state = state < LIT_STATES ? 7 : 10;
+	rep3 = rep2;
+	rep2 = rep1;
+	rep1 = rep0;
+
+	len = lzma_len(&p->match_len, pos_state);
+	slot = rc_bittree(p->dist_slot[len < DIST_STATES ? len
+					: DIST_STATES - 1],
+			  1 << DIST_SLOT_BITS);
+	if (slot < DIST_MODEL_START) {
+		rep0 = slot;
+	} else {
+		limit = (slot >> 1) - 1;
+		rep0 = 2 + (slot & 1);
+		if (slot < DIST_MODEL_END) {
+			rep0 <<= limit;
+			rc_bittree_reverse(p->dist_special + rep0 - slot - 1,
+					   &rep0, limit);
+		} else {
+			rc_direct(&rep0, limit - ALIGN_BITS);
+			rep0 <<= ALIGN_BITS;
+			rc_bittree_reverse(p->dist_align, &rep0, ALIGN_BITS);
+		}
+	}
+	return len + MATCH_LEN_MIN;
+}
+
+
+/* decode a repeated match, rotating the rep distances; returns length */
+static unsigned int
+lzma_rep_match(unsigned int pos_state)
+{
+	unsigned long tmp;
+
+	if (!rc_bit(&p->is_rep0[state])) {
+		if (!rc_bit(&p->is_rep0_long[state][pos_state])) {
+			state = state < LIT_STATES ? 9 : 11;
+			return 1;
+		}
+	} else {
+		if (!rc_bit(&p->is_rep1[state])) {
+			tmp = rep1;
+		} else {
+			if (!rc_bit(&p->is_rep2[state])) {
+				tmp = rep2;
+			} else {
+				tmp = rep3;
+				rep3 = rep2;
+			}
+			rep2 = rep1;
+		}
+		rep1 = rep0;
+		rep0 = tmp;
+	}
+	state = state < LIT_STATES ? 8 : 11;
+	return lzma_len(&p->rep_len, pos_state) + MATCH_LEN_MIN;
+}
+
+
+/* decode one LZMA chunk producing exactly OUT bytes */
+static void
+lzma_chunk(unsigned long out)
+{
+	unsigned long end = total_out + out;
+	unsigned int pos_state, len;
+
+	rc_init();
+	while (total_out < end) {
+		pos_state = total_out & pb_mask;
+		if (!rc_bit(&p->is_match[state][pos_state])) {
+			lzma_literal();
+			continue;
+		}
+		if (rc_bit(&p->is_rep[state])) {
+			if (!dict_full)
+				unzip_error("xz: repeat before any data");
+			len = lzma_rep_match(pos_state);
+		} else {
+			len = lzma_match(pos_state);
+		}
+		if (rep0 >= dict_full)
+			unzip_error("xz: match distance out of range");
+		if (len > end - total_out)
+			unzip_error("xz: match crosses chunk boundary");
+		dict_repeat(rep0, len);
+	}
+	rc_normalize();
+	if (rc_code != 0 || rc_in != rc_end)
+		unzip_error("xz: chunk size mismatch");
+}
+
+
+/* decode the LZMA2 data of one block */
+static void
+lzma2_block(void)
+{
+	unsigned int ctrl, reset, need_dict = 1, need_props = 1;
+	unsigned long out, in;
+	unsigned char b[5];
+
+	for (;;) {
+		ctrl = get_byte();
+		if (ctrl == 0x00)
+			break;
+
+		if (ctrl == 0x01 || ctrl >= 0xe0) {
+			/* dictionary reset */
+			dict_pos = dict_start = dict_full = total_out = 0;
+			need_dict = 0;
+		} else if (need_dict || (ctrl != 0x02 && ctrl < 0x80)) {
+			unzip_error("xz: bad LZMA2 control byte");
+		}
+
+		if (ctrl < 0x80) {
+			/* uncompressed chunk */
+			get_bytes(b, 2);
+			out = (b[0] << 8 | b[1]) + 1;
+			while (out) {
+				unsigned long n = dict_size - dict_pos;
+
+				if (n > out)
+					n = out;
+				get_bytes(dict + dict_pos, n);
+				dict_pos += n;
+				total_out += n;
+				dict_full += n;
+				if (dict_full > dict_size)
+					dict_full = dict_size;
+				out -= n;
+				if (dict_pos == dict_size)
+					dict_flush();
+			}
+			continue;
+		}
+
+		reset = (ctrl >> 5) & 3;
+		get_bytes(b, reset >= 2 ? 5 : 4);
+		out = ((unsigned long) (ctrl & 0x1f) << 16 | b[0] << 8 | b[1]) + 1;
+		in = (b[2] << 8 | b[3]) + 1;
+		if (reset >= 2) {
+			if (lzma_props(b[4]) < 0)
+				unzip_error("xz: bad LZMA properties");
+			need_props = 0;
+		} else if (need_props) {
+			unzip_error("xz: missing LZMA properties");
+		}
+		if (reset >= 1)
+			lzma_reset();
+
+		get_bytes(cbuf, in);
+		rc_in = cbuf;
+		rc_end = cbuf + in;
+		lzma_chunk(out);
+		dict_flush();
+	}
+	dict_flush();
+}
+
+
+static unsigned long
+get_le32(const unsigned char *b)
+{
+	return b[0] | b[1] << 8 | b[2] << 16 | (unsigned long) b[3] << 24;
+}
+
+
+/* parse a variable-length integer from *BUF, not reading past END */
+static unsigned long
+get_vli(const unsigned char **buf, const unsigned char *end)
+{
+	unsigned long v = 0;
+	int shift = 0;
+
+	do {
+		if (*buf >= end || shift > 56)
+			unzip_error("xz: bad block header");
+		v |= (unsigned long) (**buf & 0x7f) << shift;
+		shift += 7;
+	} while (*(*buf)++ & 0x80);
+	return v;
+}
+
+
+/*
+ * Read the block header whose first byte is SIZE_BYTE and set up the
+ * dictionary for it.
+ */
+static void
+block_header(unsigned int size_byte)
+{
+	unsigned char hdr[1024];
+	const unsigned char *q, *end;
+	unsigned long uncompressed = 0, need, props_size;
+	unsigned int flags, bits;
+	int hsize = (size_byte + 1) * 4;
+
+	hdr[0] = size_byte;
+	get_bytes(hdr + 1, hsize - 1);
+	updcrc(NULL, 0);
+	if (updcrc(hdr, hsize - 4) != get_le32(hdr + hsize - 4))
+		unzip_error("xz: block header crc error");
+
+	q = hdr + 2;
+	end = hdr + hsize - 4;
+	flags = hdr[1];
+	if (flags & 0x3c)
+		unzip_error("xz: unsupported block flags");
+	if ((flags & 3) != 0)
+		unzip_error("xz: only the LZMA2 filter is supported");
+	if (flags & 0x40)
+		get_vli(&q, end);		/* compressed size */
+	if (flags & 0x80)
+		uncompressed = get_vli(&q, end);
+
+	if (get_vli(&q, end) != XZ_FILTER_LZMA2)
+		unzip_error("xz: only the LZMA2 filter is supported");
+	props_size = get_vli(&q, end);
+	if (props_size != 1 || q >= end)
+		unzip_error("xz: bad LZMA2 properties");
+	bits = *q++;
+	if (bits > 40)
+		unzip_error("xz: bad LZMA2 dictionary size");
+	need = bits == 40 ? 0xffffffffUL : (2UL | (bits & 1)) << (bits / 2 + 11);
+
+	/* no point in a dictionary larger than the data */
+	if (uncompressed && uncompressed < need)
+		need = uncompressed;
+	if (need > XZ_DICT_MAX) {
+#ifdef DEBUG
+		printf("xz: limiting dictionary of %ld bytes to %d\n",
+		       need, XZ_DICT_MAX);
+#endif
+		need = XZ_DICT_MAX;
+	}
+	if (need > dict_alloc) {
+		dict = malloc(need);
+		dict_alloc = need;
+		if (bytes_out)	/* else checked with the ELF header */
+			check_overlap();
+	}
+	dict_size = need;
+	dict_pos = dict_start = dict_full = total_out = 0;
+}
+
+
+int
+unxz_kernel(int fd)
+{
+	static const int check_size[16] = {
+		0, 4, 4, 4, 8, 8, 8, 16, 16, 16, 32, 32, 32, 64, 64, 64
+	};
+	unsigned char hdr[XZ_HEADER_SIZE], check[64];
+	unsigned long start;
+	unsigned int size_byte;
+
+	start_input(fd);
+	/* the buffers of an earlier run went with its arena */
+	p = malloc(sizeof(*p));
+	cbuf = malloc(LZMA2_CHUNK_MAX);
+	crc64_tab = NULL;
+	dict_alloc = 0;
+
+	get_bytes(hdr, XZ_HEADER_SIZE);
+	updcrc(NULL, 0);
+	if (memcmp(hdr, XZ_MAGIC, 6) != 0 || hdr[6] != 0 || hdr[7] > 15
+	    || updcrc(hdr + 6, 2) != get_le32(hdr + 8))
+		unzip_error("xz: bad stream header");
+	check_type = hdr[7];
+	if (check_type == XZ_CHECK_CRC64)
+		crc64_init();
+
+	while ((size_byte = get_byte()) != 0) {	/* 0 starts the index */
+		start = input_offset() - 1;
+		block_header(size_byte);
+		xz_crc64 = 0;
+		updcrc(NULL, 0);
+		xz_crc32 = 0;
+
+		lzma2_block();
+
+		/* block padding up to a multiple of four bytes */
+		while ((input_offset() - start) & 3) {
+			if (get_byte() != 0)
+				unzip_error("xz: bad block padding");
+		}
+
+		get_bytes(check, check_size[check_type]);
+		if ((check_type == XZ_CHECK_CRC32
+		     && get_le32(check) != xz_crc32)
+		    || (check_type == XZ_CHECK_CRC64
+			&& (get_le32(check)
+			    | (unsigned long) get_le32(check + 4) << 32)
+			   != xz_crc64))
+			unzip_error("xz: crc error");
+#ifdef DEBUG
+		printf("xz: block of %ld bytes done\n", total_out);
+#endif
+	}
+	/* the index and stream footer only repeat what we have seen */
+	if (!bytes_out)
+		unzip_error("xz: no data");
+	return 1;
+}
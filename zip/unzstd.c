@@ -0,0 +1,1055 @@
+/*
+ * unzstd.c
+ *
+ * Decoder for zstd-compressed kernels.  Only what a kernel image needs
+ * is supported: a single frame that records its content size, without
+ * a dictionary.  The frame checksum, when present, is verified.
+ *
+ * Decoded data goes through a circular window sized from the frame
+ * header, shrunk to the content size and to the memory left between
+ * the kernel and free_mem_ptr.  Each block is flushed from it into the
+ * kernel segments with place_output().  Compressed blocks are fetched
+ * whole with get_bytes(), so most of the input moves in large breads.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ */
+#include "aboot.h"
+#include "bootfs.h"
+#include "utils.h"
+#include "gzip.h"
+
+#define ZSTD_BLOCK_MAX	(128*1024)	/* largest block, in or out */
+#define ZSTD_WINDOW_MIN	(1 << 10)
+
+#define HUF_MAX_BITS	11
+#define HUF_MAX_SYMBOLS	256
+
+#define LL_MAX_SYMBOL	35
+#define ML_MAX_SYMBOL	52
+#define OF_MAX_SYMBOL	31
+#define LL_MAX_LOG	9
+#define ML_MAX_LOG	9
+#define OF_MAX_LOG	8
+#define WEIGHT_MAX_LOG	6
+
+#define PRIME64_1	0x9e3779b185ebca87UL
+#define PRIME64_2	0xc2b2ae3d27d4eb4fUL
+#define PRIME64_3	0x165667b19e3779f9UL
+#define PRIME64_4	0x85ebca77c2b2ae63UL
+#define PRIME64_5	0x27d4eb2f165667c5UL
+
+struct fse_entry {
+	unsigned char	symbol;
+	unsigned char	nbits;
+	unsigned short	base;
+};
+
+struct fse_table {
+	int		log;		/* -1 until the first table is read */
+	struct fse_entry entries[1 << LL_MAX_LOG];
+};
+
+struct huf_entry {
+	unsigned char	symbol;
+	unsigned char	nbits;
+};
+
+/* reads a backward bitstream: bits are consumed from the top down */
+struct bits {
+	const unsigned char *buf;
+	long		len;
+	long		pos;		/* unread bits, < 0 once overrun */
+};
+
+static const unsigned int ll_base[LL_MAX_SYMBOL + 1] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024,
+	2048, 4096, 8192, 16384, 32768, 65536
+};
+static const unsigned char ll_bits[LL_MAX_SYMBOL + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+	13, 14, 15, 16
+};
+static const unsigned int ml_base[ML_MAX_SYMBOL + 1] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+	19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+	35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027,
+	2051, 4099, 8195, 16387, 32771, 65539
+};
+static const unsigned char ml_bits[ML_MAX_SYMBOL + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+	12, 13, 14, 15, 16
+};
+
+/* default distributions, used by the "predefined" table mode */
+static const short ll_default[LL_MAX_SYMBOL + 1] = {
+	4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+	-1, -1, -1, -1
+};
+static const short ml_default[ML_MAX_SYMBOL + 1] = {
+	1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+	-1, -1, -1, -1, -1
+};
+static const short of_default[29] = {
+	1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+/* state carried from block to block */
+static struct fse_table *ll_table, *ml_table, *of_table;
+static struct huf_entry *huf_table;
+static int huf_bits;			/* 0 until a tree has been read */
+static unsigned long rep[3];
+
+static struct fse_table *weight_table;	/* for Huffman weights */
+
+static unsigned char *cbuf;		/* one compressed block */
+static unsigned char *lits;		/* literals of the current block */
+
+/* circular window */
+static unsigned char *win;
+static unsigned long win_size;
+static unsigned long win_pos;		/* next byte written */
+static unsigned long win_start;		/* first byte not flushed yet */
+static unsigned long total_out;		/* bytes decoded in this frame */
+
+/* running xxhash64 of the output */
+static unsigned long xxh_v[4];
+static unsigned char xxh_buf[32];
+static unsigned int xxh_buffered;
+static unsigned long xxh_len;
+
+
+static inline unsigned long
+get_le64(const unsigned char *p)
+{
+	unsigned long v;
+
+	__builtin_memcpy(&v, p, sizeof(v));	/* little-endian host */
+	return v;
+}
+
+
+static inline unsigned long
+rotl64(unsigned long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+
+static inline unsigned long
+xxh_round(unsigned long acc, unsigned long input)
+{
+	acc += input * PRIME64_2;
+	return rotl64(acc, 31) * PRIME64_1;
+}
+
+
+static inline unsigned long
+xxh_merge(unsigned long acc, unsigned long val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+static void
+xxh_init(void)
+{
+	xxh_v[0] = PRIME64_1 + PRIME64_2;
+	xxh_v[1] = PRIME64_2;
+	xxh_v[2] = 0;
+	xxh_v[3] = -PRIME64_1;
+	xxh_buffered = 0;
+	xxh_len = 0;
+}
+
+
+static void
+xxh_stripe(const unsigned char *p)
+{
+	xxh_v[0] = xxh_round(xxh_v[0], get_le64(p));
+	xxh_v[1] = xxh_round(xxh_v[1], get_le64(p + 8));
+	xxh_v[2] = xxh_round(xxh_v[2], get_le64(p + 16));
+	xxh_v[3] = xxh_round(xxh_v[3], get_le64(p + 24));
+}
+
+
+static void
+xxh_update(const unsigned char *p, unsigned long n)
+{
+	unsigned long take;
+
+	xxh_len += n;
+	if (xxh_buffered) {
+		take = 32 - xxh_buffered;
+		if (take > n)
+			take = n;
+		memcpy(xxh_buf + xxh_buffered, p, take);
+		xxh_buffered += take;
+		p += take;
+		n -= take;
+		if (xxh_buffered < 32)
+			return;
+		xxh_stripe(xxh_buf);
+		xxh_buffered = 0;
+	}
+	for (; n >= 32; p += 32, n -= 32)
+		xxh_stripe(p);
+	memcpy(xxh_buf, p, n);
+	xxh_buffered = n;
+}
+
+
+static unsigned long
+xxh_digest(void)
+{
+	const unsigned char *p = xxh_buf;
+	unsigned int n = xxh_buffered;
+	unsigned long h, k;
+
+	if (xxh_len >= 32) {
+		h = rotl64(xxh_v[0], 1) + rotl64(xxh_v[1], 7)
+			+ rotl64(xxh_v[2], 12) + rotl64(xxh_v[3], 18);
+		h = xxh_merge(h, xxh_v[0]);
+		h = xxh_merge(h, xxh_v[1]);
+		h = xxh_merge(h, xxh_v[2]);
+		h = xxh_merge(h, xxh_v[3]);
+	} else {
+		h = PRIME64_5;
+	}
+	h += xxh_len;
+
+	for (; n >= 8; p += 8, n -= 8) {
+		h ^= xxh_round(0, get_le64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (n >= 4) {
+		k = p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+		h ^= k * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		n -= 4;
+	}
+	while (n--) {
+		h ^= *p++ * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+/* index of the highest bit set in X, which must not be 0 */
+static inline int
+highbit(unsigned long x)
+{
+	int n = 0;
+
+	while (x >>= 1)
+		n++;
+	return n;
+}
+
+
+/*
+ * Window handling.  win_flush() hands everything decoded since the
+ * last flush to the loader; the data stays in the window as history.
+ */
+static void
+win_flush(void)
+{
+	unsigned long n = win_pos - win_start;
+
+	if (!n)
+		return;
+	xxh_update(win + win_start, n);
+	place_output(win + win_start, n);
+	if (win_pos == win_size)
+		win_pos = 0;
+	win_start = win_pos;
+}
+
+
+static void
+win_literals(const unsigned char *src, unsigned long n)
+{
+	unsigned long room;
+
+	total_out += n;
+	while (n) {
+		room = win_size - win_pos;
+		if (room > n)
+			room = n;
+		memcpy(win + win_pos, src, room);
+		win_pos += room;
+		src += room;
+		n -= room;
+		if (win_pos == win_size)
+			win_flush();
+	}
+}
+
+
+static void
+win_match(unsigned long offset, unsigned long len)
+{
+	unsigned long from;
+	unsigned char *dst, *src;
+
+	if (offset > total_out || offset > win_size)
+		unzip_error("zstd: match distance out of range");
+	total_out += len;
+	while (len) {
+		from = win_pos >= offset ? win_pos - offset
+					 : win_pos + win_size - offset;
+		if (offset >= 8 && from + len <= win_size
+		    && win_pos + len < win_size)
+		{
+			/* neither end wraps: a word at a time */
+			dst = win + win_pos;
+			src = win + from;
+			win_pos += len;
+			for (; len >= 8; len -= 8, dst += 8, src += 8)
+				__builtin_memcpy(dst, src, 8);
+			while (len--)
+				*dst++ = *src++;
+			return;
+		}
+		win[win_pos++] = win[from];
+		len--;
+		if (win_pos == win_size)
+			win_flush();
+	}
+}
+
+
+/*
+ * Backward bitstreams.  The last byte holds a marker bit above the
+ * first bit to be read; reading runs towards the start of the buffer
+ * and yields zeros once it passes the start.
+ */
+static void
+bits_init(struct bits *b, const unsigned char *buf, long len)
+{
+	if (len <= 0 || buf[len - 1] == 0)
+		unzip_error("zstd: bad bitstream");
+	b->buf = buf;
+	b->len = len;
+	b->pos = (len - 1) * 8 + highbit(buf[len - 1]);
+}
+
+
+static inline unsigned long
+bits_peek(const struct bits *b, int n)
+{
+	long at = b->pos - n;
+	unsigned long v = 0;
+	int i;
+
+	if (at >= 0 && (at >> 3) + 8 <= b->len)
+		return (get_le64(b->buf + (at >> 3)) >> (at & 7))
+			& ((1UL << n) - 1);
+
+	/* near either end of the buffer */
+	for (i = n - 1; i >= 0; i--) {
+		v <<= 1;
+		if (at + i >= 0)
+			v |= (b->buf[(at + i) >> 3] >> ((at + i) & 7)) & 1;
+	}
+	return v;
+}
+
+
+static inline unsigned long
+bits_read(struct bits *b, int n)
+{
+	unsigned long v = bits_peek(b, n);
+
+	b->pos -= n;
+	return v;
+}
+
+
+/*
+ * Build the decoding table for the normalized distribution NORM[]
+ * of NSYMBOLS symbols with accuracy LOG.
+ */
+static void
+fse_build(struct fse_table *t, const short *norm, int nsymbols, int log)
+{
+	unsigned short next[HUF_MAX_SYMBOLS];
+	unsigned int size = 1 << log, mask = size - 1;
+	unsigned int high = size - 1, pos = 0, step, i;
+	int s, n;
+
+	step = (size >> 1) + (size >> 3) + 3;
+	for (s = 0; s < nsymbols; s++) {
+		if (norm[s] == -1) {
+			/* "less than one": the last cells, full width */
+			t->entries[high--].symbol = s;
+			next[s] = 1;
+		} else {
+			next[s] = norm[s];
+		}
+	}
+	for (s = 0; s < nsymbols; s++) {
+		for (n = 0; n < norm[s]; n++) {
+			t->entries[pos].symbol = s;
+			do
+				pos = (pos + step) & mask;
+			while (pos > high);
+		}
+	}
+	if (pos != 0)
+		unzip_error("zstd: bad FSE distribution");
+
+	for (i = 0; i < size; i++) {
+		struct fse_entry *e = &t->entries[i];
+		unsigned int state = next[e->symbol]++;
+
+		e->nbits = log - highbit(state);
+		e->base = (state << e->nbits) - size;
+	}
+	t->log = log;
+}
+
+
+/* the bits of SRC[0..LEN-1] from bit BIT on, zero past the end */
+static unsigned long
+fwd_peek(const unsigned char *src, long len, long bit)
+{
+	unsigned long v = 0;
+	long i, byte = bit >> 3;
+
+	for (i = 0; i < 5; i++)
+		if (byte + i < len)
+			v |= (unsigned long) src[byte + i] << (8 * i);
+	return v >> (bit & 7);
+}
+
+
+/*
+ * Read an FSE table description from SRC[0..LEN-1] and build the
+ * table.  Returns the number of bytes used.
+ */
+static long
+fse_read(struct fse_table *t, const unsigned char *src, long len,
+	 int max_symbol, int max_log)
+{
+	short norm[HUF_MAX_SYMBOLS];
+	long bit = 0;
+	int log, remaining, threshold, nbits, symbol = 0;
+	int count, max, zeros;
+	unsigned long v;
+
+	if (len < 1)
+		unzip_error("zstd: truncated FSE table");
+	log = (src[0] & 15) + 5;
+	if (log > max_log)
+		unzip_error("zstd: FSE accuracy too large");
+	bit = 4;
+	remaining = (1 << log) + 1;
+	threshold = 1 << log;
+	nbits = log + 1;
+
+	while (remaining > 1 && symbol <= max_symbol) {
+		v = fwd_peek(src, len, bit);
+		max = 2 * threshold - 1 - remaining;
+		if ((int) (v & (threshold - 1)) < max) {
+			count = v & (threshold - 1);
+			bit += nbits - 1;
+		} else {
+			count = v & (2 * threshold - 1);
+			if (count >= threshold)
+				count -= max;
+			bit += nbits;
+		}
+		count--;		/* -1 is "less than one" */
+		remaining -= count < 0 ? -count : count;
+		norm[symbol++] = count;
+		while (remaining < threshold) {
+			nbits--;
+			threshold >>= 1;
+		}
+
+		if (count == 0) {
+			/* a run of zero probabilities follows */
+			do {
+				v = fwd_peek(src, len, bit) & 3;
+				bit += 2;
+				for (zeros = v; zeros > 0; zeros--) {
+					if (symbol > max_symbol)
+						unzip_error("zstd: bad FSE table");
+					norm[symbol++] = 0;
+				}
+			} while (v == 3);
+		}
+	}
+	if (remaining != 1 || (bit + 7) / 8 > len)
+		unzip_error("zstd: bad FSE table");
+
+	fse_build(t, norm, symbol, log);
+	return (bit + 7) / 8;
+}
+
+
+/* a table that always decodes SYMBOL, for the "RLE" table mode */
+static void
+fse_rle(struct fse_table *t, unsigned int symbol)
+{
+	t->entries[0].symbol = symbol;
+	t->entries[0].nbits = 0;
+	t->entries[0].base = 0;
+	t->log = 0;
+}
+
+
+/*
+ * Build the Huffman decoding table from the weights of the first
+ * NWEIGHTS symbols; the last symbol's weight is implied.
+ */
+static void
+huf_build(unsigned char *weights, int nweights)
+{
+	unsigned int rank_start[HUF_MAX_BITS + 2];
+	unsigned long total = 0, rest;
+	unsigned int len, j;
+	int i, w;
+
+	if (nweights >= HUF_MAX_SYMBOLS)
+		unzip_error("zstd: too many Huffman weights");
+	for (i = 0; i < nweights; i++) {
+		if (weights[i] > HUF_MAX_BITS)
+			unzip_error("zstd: bad Huffman weight");
+		if (weights[i])
+			total += 1UL << (weights[i] - 1);
+	}
+	if (!total)
+		unzip_error("zstd: empty Huffman tree");
+	huf_bits = highbit(total) + 1;
+	if (huf_bits > HUF_MAX_BITS)
+		unzip_error("zstd: Huffman tree too deep");
+	rest = (1UL << huf_bits) - total;
+	if (rest & (rest - 1))
+		unzip_error("zstd: bad Huffman tree");
+	weights[nweights++] = highbit(rest) + 1;
+
+	/* codes are assigned from the lowest weight (longest code) up */
+	memset(rank_start, 0, sizeof(rank_start));
+	for (i = 0; i < nweights; i++)
+		if (weights[i])
+			rank_start[weights[i]] += 1 << (weights[i] - 1);
+	for (w = 1, j = 0; w <= HUF_MAX_BITS + 1; w++) {
+		len = rank_start[w];
+		rank_start[w] = j;
+		j += len;
+	}
+	for (i = 0; i < nweights; i++) {
+		w = weights[i];
+		if (!w)
+			continue;
+		len = 1 << (w - 1);
+		for (j = rank_start[w]; j < rank_start[w] + len; j++) {
+			huf_table[j].symbol = i;
+			huf_table[j].nbits = huf_bits + 1 - w;
+		}
+		rank_start[w] += len;
+	}
+}
+
+
+/* read a Huffman tree description; returns the bytes it takes */
+static long
+huf_read(const unsigned char *src, long len)
+{
+	unsigned char weights[HUF_MAX_SYMBOLS + 1];
+	struct fse_entry *e;
+	struct bits b;
+	unsigned int s1, s2;
+	long hsize, used;
+	int n = 0, i;
+
+	if (len < 1)
+		unzip_error("zstd: truncated literals");
+	hsize = src[0];
+	if (hsize >= 128) {
+		/* weights stored directly, four bits each */
+		n = hsize - 127;
+		hsize = (n + 1) / 2;
+		if (1 + hsize > len)
+			unzip_error("zstd: truncated literals");
+		for (i = 0; i < n; i++)
+			weights[i] = i & 1 ? src[1 + i / 2] & 15
+					   : src[1 + i / 2] >> 4;
+		huf_build(weights, n);
+		return 1 + hsize;
+	}
+
+	/* FSE compressed weights, two interleaved states */
+	if (1 + hsize > len)
+		unzip_error("zstd: truncated literals");
+	used = fse_read(weight_table, src + 1, hsize, 12, WEIGHT_MAX_LOG);
+	bits_init(&b, src + 1 + used, hsize - used);
+	s1 = bits_read(&b, weight_table->log);
+	s2 = bits_read(&b, weight_table->log);
+	for (;;) {
+		if (n >= HUF_MAX_SYMBOLS - 2)
+			unzip_error("zstd: too many Huffman weights");
+		e = &weight_table->entries[s1];
+		weights[n++] = e->symbol;
+		s1 = e->base + bits_read(&b, e->nbits);
+		if (b.pos < 0) {
+			weights[n++] = weight_table->entries[s2].symbol;
+			break;
+		}
+		e = &weight_table->entries[s2];
+		weights[n++] = e->symbol;
+		s2 = e->base + bits_read(&b, e->nbits);
+		if (b.pos < 0) {
+			weights[n++] = weight_table->entries[s1].symbol;
+			break;
+		}
+	}
+	huf_build(weights, n);
+	return 1 + hsize;
+}
+
+
+/* decode one Huffman stream of SRC[0..LEN-1] into DST[0..N-1] */
+static void
+huf_stream(unsigned char *dst, unsigned long n, const unsigned char *src,
+	   long len)
+{
+	const struct huf_entry *e;
+	struct bits b;
+
+	bits_init(&b, src, len);
+	while (n--) {
+		e = &huf_table[bits_peek(&b, huf_bits)];
+		*dst++ = e->symbol;
+		b.pos -= e->nbits;
+	}
+	if (b.pos != 0)
+		unzip_error("zstd: bad Huffman stream");
+}
+
+
+/*
+ * Decode the literals section at the start of SRC[0..LEN-1].  Sets
+ * *LITP and *NLITS to the literals and returns the section size.
+ */
+static long
+literals(const unsigned char *src, long len, const unsigned char **litp,
+	 unsigned long *nlits)
+{
+	unsigned int type = src[0] & 3, format = (src[0] >> 2) & 3;
+	unsigned long regen, csize, h, stream;
+	long hdr, tree = 0, jump, in;
+	int streams, i;
+
+	if (type < 2) {
+		/* raw or RLE */
+		switch (format) {
+		      case 1:
+			hdr = 2;
+			regen = src[0] >> 4 | src[1] << 4;
+			break;
+		      case 3:
+			hdr = 3;
+			regen = src[0] >> 4 | src[1] << 4 | src[2] << 12;
+			break;
+		      default:
+			hdr = 1;
+			regen = src[0] >> 3;
+			break;
+		}
+		if (hdr > len)
+			unzip_error("zstd: truncated literals");
+		if (regen > ZSTD_BLOCK_MAX)
+			unzip_error("zstd: too many literals");
+		*nlits = regen;
+		if (type == 0) {
+			if (hdr + (long) regen > len)
+				unzip_error("zstd: truncated literals");
+			*litp = src + hdr;
+			return hdr + regen;
+		}
+		if (hdr + 1 > len)
+			unzip_error("zstd: truncated literals");
+		memset(lits, src[hdr], regen);
+		*litp = lits;
+		return hdr + 1;
+	}
+
+	/* Huffman compressed, with a new tree or the previous one */
+	hdr = format < 2 ? 3 : format + 2;
+	if (hdr > len)
+		unzip_error("zstd: truncated literals");
+	for (h = 0, i = hdr - 1; i >= 0; i--)
+		h = h << 8 | src[i];
+	streams = format == 0 ? 1 : 4;
+	i = format < 2 ? 10 : format == 2 ? 14 : 18;
+	regen = (h >> 4) & ((1UL << i) - 1);
+	csize = (h >> (4 + i)) & ((1UL << i) - 1);
+	if (regen > ZSTD_BLOCK_MAX)
+		unzip_error("zstd: too many literals");
+	if (hdr + (long) csize > len)
+		unzip_error("zstd: truncated literals");
+
+	src += hdr;
+	if (type == 2) {
+		tree = huf_read(src, csize);
+	} else if (!huf_bits) {
+		unzip_error("zstd: no Huffman tree to repeat");
+	}
+	in = csize - tree;
+
+	if (streams == 1) {
+		huf_stream(lits, regen, src + tree, in);
+	} else {
+		const unsigned char *jt = src + tree;
+		unsigned long per = (regen + 3) / 4, out = 0, n;
+		long at = 6;
+
+		if (in < 10 || regen < 6)
+			unzip_error("zstd: bad literals streams");
+		for (i = 0; i < 4; i++) {
+			if (i < 3) {
+				jump = jt[2 * i] | jt[2 * i + 1] << 8;
+			} else {
+				jump = in - at;
+			}
+			n = i < 3 ? per : regen - out;
+			stream = at + jump;
+			if (jump <= 0 || stream > (unsigned long) in)
+				unzip_error("zstd: bad literals streams");
+			huf_stream(lits + out, n, jt + at, jump);
+			at = stream;
+			out += n;
+		}
+	}
+	*litp = lits;
+	*nlits = regen;
+	return hdr + csize;
+}
+
+
+/*
+ * Set up the table for one sequence field according to MODE; returns
+ * the bytes of SRC[0..LEN-1] used.
+ */
+static long
+seq_table(struct fse_table *t, unsigned int mode, const unsigned char *src,
+	  long len, const short *defaults, int ndefaults, int default_log,
+	  int max_symbol, int max_log)
+{
+	switch (mode) {
+	      case 0:			/* predefined */
+		fse_build(t, defaults, ndefaults, default_log);
+		return 0;
+	      case 1:			/* RLE */
+		if (len < 1 || src[0] > max_symbol)
+			unzip_error("zstd: bad sequence table");
+		fse_rle(t, src[0]);
+		return 1;
+	      case 2:			/* FSE compressed */
+		return fse_read(t, src, len, max_symbol, max_log);
+	      default:			/* repeat */
+		if (t->log < 0)
+			unzip_error("zstd: no sequence table to repeat");
+		return 0;
+	}
+}
+
+
+static inline unsigned int
+fse_init(const struct fse_table *t, struct bits *b)
+{
+	return bits_read(b, t->log);
+}
+
+
+static inline unsigned int
+fse_update(const struct fse_table *t, unsigned int state, struct bits *b)
+{
+	const struct fse_entry *e = &t->entries[state];
+
+	return e->base + bits_read(b, e->nbits);
+}
+
+
+/* decode the compressed block SRC[0..LEN-1] into the window */
+static void
+compressed_block(const unsigned char *src, long len)
+{
+	const unsigned char *lit;
+	unsigned long nlits, nseq, ll, ml, of, offset, out = 0;
+	unsigned int ll_state, ml_state, of_state, llc, mlc, ofc, modes;
+	struct bits b;
+	long used;
+
+	used = literals(src, len, &lit, &nlits);
+	src += used;
+	len -= used;
+
+	if (len < 1)
+		unzip_error("zstd: truncated sequences");
+	nseq = src[0];
+	if (nseq < 128) {
+		used = 1;
+	} else if (nseq < 255) {
+		if (len < 2)
+			unzip_error("zstd: truncated sequences");
+		nseq = ((nseq - 128) << 8) + src[1];
+		used = 2;
+	} else {
+		if (len < 3)
+			unzip_error("zstd: truncated sequences");
+		nseq = src[1] + (src[2] << 8) + 0x7f00;
+		used = 3;
+	}
+	src += used;
+	len -= used;
+
+	if (nseq) {
+		if (len < 1 || (src[0] & 3))
+			unzip_error("zstd: bad sequence modes");
+		modes = src[0];
+		src++;
+		len--;
+		used = seq_table(ll_table, modes >> 6, src, len, ll_default,
+				 LL_MAX_SYMBOL + 1, 6, LL_MAX_SYMBOL,
+				 LL_MAX_LOG);
+		src += used;
+		len -= used;
+		used = seq_table(of_table, (modes >> 4) & 3, src, len,
+				 of_default, 29, 5, OF_MAX_SYMBOL, OF_MAX_LOG);
+		src += used;
+		len -= used;
+		used = seq_table(ml_table, (modes >> 2) & 3, src, len,
+				 ml_default, ML_MAX_SYMBOL + 1, 6,
+				 ML_MAX_SYMBOL, ML_MAX_LOG);
+		src += used;
+		len -= used;
+
+		bits_init(&b, src, len);
+		ll_state = fse_init(ll_table, &b);
+		of_state = fse_init(of_table, &b);
+		ml_state = fse_init(ml_table, &b);
+
+		while (nseq--) {
+			llc = ll_table->entries[ll_state].symbol;
+			mlc = ml_table->entries[ml_state].symbol;
+			ofc = of_table->entries[of_state].symbol;
+			if (llc > LL_MAX_SYMBOL || mlc > ML_MAX_SYMBOL
+			    || ofc > OF_MAX_SYMBOL)
+				unzip_error("zstd: bad sequence code");
+
+			of = (1UL << ofc) + bits_read(&b, ofc);
+			ml = ml_base[mlc] + bits_read(&b, ml_bits[mlc]);
+			ll = ll_base[llc] + bits_read(&b, ll_bits[llc]);
+
+			if (of > 3) {
+				offset = of - 3;
+				rep[2] = rep[1];
+				rep[1] = rep[0];
+			} else {
+				of = of - 1 + (ll == 0);
+				if (of == 0) {
+					offset = rep[0];
+				} else {
+					offset = of == 3 ? rep[0] - 1 : rep[of];
+					if (of != 1)
+						rep[2] = rep[1];
+					rep[1] = rep[0];
+				}
+			}
+			rep[0] = offset;
+
+			if (ll > nlits || out + ll + ml > ZSTD_BLOCK_MAX)
+				unzip_error("zstd: sequence too long");
+			if (!offset)
+				unzip_error("zstd: zero match distance");
+			win_literals(lit, ll);
+			lit += ll;
+			nlits -= ll;
+			win_match(offset, ml);
+			out += ll + ml;
+
+			if (nseq) {
+				ll_state = fse_update(ll_table, ll_state, &b);
+				ml_state = fse_update(ml_table, ml_state, &b);
+				of_state = fse_update(of_table, of_state, &b);
+			}
+		}
+		if (b.pos != 0)
+			unzip_error("zstd: bad sequence stream");
+	} else if (len != 0) {
+		unzip_error("zstd: trailing data in block");
+	}
+
+	if (out + nlits > ZSTD_BLOCK_MAX)
+		unzip_error("zstd: block too large");
+	win_literals(lit, nlits);
+}
+
+
+/*
+ * Allocate the window for a frame declaring WANT bytes of window and
+ * CONTENT bytes of output.  The window goes below free_mem_ptr, and
+ * the kernel is expected to take about CONTENT bytes from start_addr
+ * up, so leave that much room.
+ */
+static void
+win_alloc(unsigned long want, unsigned long content)
+{
+	if (want > content)
+		want = content;
+	if (want < ZSTD_WINDOW_MIN)
+		want = ZSTD_WINDOW_MIN;
+#ifndef TESTING
+	{
+		unsigned long top = start_addr + content + ZSTD_BLOCK_MAX;
+		unsigned long room = free_mem_ptr > top ? free_mem_ptr - top
+							: 0;
+
+		room &= ~(ZSTD_WINDOW_MIN - 1);
+		if (room < ZSTD_BLOCK_MAX)
+			unzip_error("zstd: no memory for the window");
+		if (want > room) {
+			printf("aboot: zstd window limited to %ld bytes\n",
+			       room);
+			want = room;
+		}
+	}
+#endif
+	win = malloc(want);
+	win_size = want;
+	win_pos = win_start = total_out = 0;
+}
+
+
+int
+unzstd_kernel(int fd)
+{
+	unsigned char b[8];
+	unsigned long content = 0, want, size;
+	unsigned int fhd, did_size, fcs_size, last, type;
+	int i;
+
+	start_input(fd);
+	get_bytes(b, 5);
+	if (memcmp(b, ZSTD_MAGIC, 4) != 0)
+		unzip_error("bad zstd magic");
+
+	/* frame header */
+	fhd = b[4];
+	if (fhd & 0x08)
+		unzip_error("zstd: reserved frame header bit set");
+	did_size = (fhd & 3) == 3 ? 4 : fhd & 3;
+	fcs_size = fhd >> 6 ? 1 << (fhd >> 6) : (fhd & 0x20) ? 1 : 0;
+	want = 0;
+	if (!(fhd & 0x20)) {
+		/* window descriptor */
+		i = get_byte();
+		want = 1UL << (10 + (i >> 3));
+		want += (want >> 3) * (i & 7);
+	}
+	if (did_size) {
+		get_bytes(b, did_size);
+		for (i = 0; i < (int) did_size; i++)
+			if (b[i])
+				unzip_error("zstd: dictionaries not supported");
+	}
+	if (!fcs_size)
+		unzip_error("zstd: frame has no content size");
+	get_bytes(b, fcs_size);
+	for (i = fcs_size - 1; i >= 0; i--)
+		content = content << 8 | b[i];
+	if (fcs_size == 2)
+		content += 256;
+	if (!content)
+		unzip_error("zstd: empty frame");
+	if (fhd & 0x20)
+		want = content;		/* single segment */
+#ifdef DEBUG
+	printf("zstd: window %ld, content %ld bytes\n", want, content);
+#endif
+
+	cbuf = malloc(ZSTD_BLOCK_MAX);
+	lits = malloc(ZSTD_BLOCK_MAX);
+	huf_table = malloc(sizeof(*huf_table) << HUF_MAX_BITS);
+	weight_table = malloc(sizeof(*weight_table));
+	ll_table = malloc(sizeof(*ll_table));
+	ml_table = malloc(sizeof(*ml_table));
+	of_table = malloc(sizeof(*of_table));
+	win_alloc(want, content);
+	ll_table->log = ml_table->log = of_table->log = -1;
+	huf_bits = 0;
+	rep[0] = 1;
+	rep[1] = 4;
+	rep[2] = 8;
+	xxh_init();
+
+	do {
+		get_bytes(b, 3);
+		size = b[0] >> 3 | b[1] << 5 | b[2] << 13;
+		last = b[0] & 1;
+		type = (b[0] >> 1) & 3;
+		if (type == 3 || size > ZSTD_BLOCK_MAX)
+			unzip_error("zstd: bad block header");
+
+		switch (type) {
+		      case 0:		/* raw */
+			while (size) {
+				unsigned long n = win_size - win_pos;
+
+				if (n > size)
+					n = size;
+				get_bytes(win + win_pos, n);
+				win_pos += n;
+				total_out += n;
+				size -= n;
+				if (win_pos == win_size)
+					win_flush();
+			}
+			break;
+		      case 1:		/* RLE */
+			memset(cbuf, get_byte(), size);
+			win_literals(cbuf, size);
+			break;
+		      case 2:		/* compressed */
+			get_bytes(cbuf, size);
+			compressed_block(cbuf, size);
+			break;
+		}
+		if (total_out > content)
+			unzip_error("zstd: more data than the frame declares");
+		win_flush();
+	} while (!last);
+
+	if (total_out != content)
+		unzip_error("zstd: frame shorter than declared");
+	if (fhd & 0x04) {
+		get_bytes(b, 4);
+		if ((b[0] | b[1] << 8 | b[2] << 16 | (unsigned long) b[3] << 24)
+		    != (xxh_digest() & 0xffffffff))
+			unzip_error("zstd: checksum error");
+	}
+	return 1;
+}